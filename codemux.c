@@ -1,12 +1,17 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,15 +20,24 @@
 #include <string.h>
 #include "codemuxlib.h"
 #include "debug.h"
+#include "radix.h"
+#include "httpmsg.h"
+#include "http2.h"
+#include "dnscache.h"
 
 #ifdef DEBUG
 HANDLE hdebugLog;
 int defaultTraceSync;
 #endif
 
-#define CONF_FILE "/etc/codemux/codemux.conf"
+#define CONF_DIR "/etc/codemux"
+#define CONF_NAME "codemux.conf"
+#define SNAP_NAME "codemux.snap"
+#define CONF_FILE CONF_DIR "/" CONF_NAME
+#define SNAP_FILE CONF_DIR "/" SNAP_NAME
 #define DEMUX_PORT 80
 #define PIDFILE "/var/run/codemux.pid"
+#define CTL_SOCK "/var/run/codemux.ctl"
 #define TARG_SETSIZE 4096
 
 /* set aside some small number of fds for us, allow the rest for
@@ -44,6 +58,7 @@ typedef struct FlowBuf {
   int fb_refs;			/* num refs */
   char *fb_buf;			/* actual buffer */
   int fb_used;			/* bytes used in buffer */
+  int fb_start;			/* first byte not yet written */
 } FlowBuf;
 #define FB_SIZE 3800		/* max usable size */
 #define FB_ALLOCSIZE 4000	/* extra to include IP address */
@@ -53,37 +68,451 @@ typedef struct SockInfo {
   struct in_addr si_cliAddr;	/* address of client */
   int si_blocked;		/* are we blocked? */
   int si_needsHeaderSince;	/* since when are we waiting for a header */
-  int si_whichService;		/* index of service */
+  long long si_hdrStartMs;	/* the same, in ms */
+  int si_hdrBytes;		/* header bytes read so far */
+  long long si_hdrDeadline;	/* when it's too slow, in ms, for hdrHeap */
+  int si_hdrHeapPos;		/* in hdrHeap, plus one, or 0 */
+  struct ServiceSig *si_service; /* service we're connected to */
+  int si_backend;		/* which of its backends */
+  int si_connecting;		/* connect still in progress */
+  int si_connectSince;
+  int si_tries;			/* failed connects for this client */
+  int si_firstBackend;		/* backend the first try went to */
+  unsigned int si_urlHash;	/* of host and URL, for balance=hash-url */
+  struct ServiceSig *si_probeService; /* set if this is a health probe */
+  HttpMsg *si_msg;		/* request or response, if the service pools */
+  int si_idleSince;		/* parked in its backend's pool since */
+  int si_nextIdle;		/* next in the pool */
+  int si_keepAlive;		/* client can send another request */
+  int si_numRequests;		/* requests before the current one */
+  FlowBuf *si_pipelined;	/* sent after the current request */
+  int si_upgrade;		/* client's request asks for Upgrade */
+  int si_tunnel;		/* backend side of an Upgrade request */
+  int si_lastActive;		/* last read */
+  int si_tls;			/* came in on the TLS listener */
+  int si_throttled;		/* reads paused for its rate */
+  int si_clientSlot;		/* in clients, plus one, or 0 */
+  int si_queuedOn;		/* slice it waits on, plus one, or 0 */
+  long long si_queuedSince;	/* in ms */
+  int si_queueNext;		/* fd plus one, or 0 */
+  int si_queuePrev;
+  int si_queueReply;		/* can be sent a 503 */
+  struct ServiceSig *si_queuedService; /* where it goes, with a ref */
+  int si_tokens;		/* bytes it may still read, for conn-rate */
+  long long si_tokensAt;	/* when they were last topped up, in ms */
   FlowBuf *si_readBuf;		/* read data into this buffer */
   FlowBuf *si_writeBuf;		/* drain this buffer for writing */
 } SockInfo;
 
 static SockInfo sockInfo[TARG_SETSIZE]; /* fd number of peer socket */
 
+/* a mapped snapshot, kept until nothing points into it */
+typedef struct SnapMap {
+  int sm_refs;
+  char *sm_addr;
+  size_t sm_len;
+} SnapMap;
+
+/* where a backend listens - over TCP, or a UNIX socket when the
+   slice runs on this host */
+typedef union BackendAddr {
+  struct sockaddr ba_sa;
+  struct sockaddr_in ba_in;
+  struct sockaddr_un ba_un;
+} BackendAddr;
+
+/* one place a service's connections can go. the breaker opens
+   after a run of failed connects, and then nothing is sent its way
+   until a single trial connect is let through */
+typedef struct Backend {
+  BackendAddr be_addr;
+  socklen_t be_addrLen;
+  char *be_name;		/* "ip:port" or "unix:/path" */
+  int be_weight;			/* 1 to BACKEND_WEIGHT_MAX */
+  int be_numConns;		/* connections open to it now */
+  int be_current;		/* weighted round robin credit */
+  int be_state;			/* BREAKER_* */
+  int be_failures;		/* failed connects in a row */
+  int be_openedAt;
+  int be_trying;		/* half-open trial in progress */
+  int be_numOpened;		/* transitions, for the status page */
+  int be_numHalfOpened;
+  int be_numClosed;
+  int be_healthy;		/* last health probes passed */
+  int be_probeFails;		/* failed probes in a row */
+  int be_nextProbe;
+  int be_probeFd;		/* probe in flight, or -1 */
+  int be_probeStarted;
+  char be_probeBuf[16];		/* start of the probe's reply */
+  int be_probeUsed;
+  int be_idleFd;		/* pooled connections, -1 if none */
+  int be_numIdle;
+  int be_numReused;
+  int be_dns;			/* name cache entry, or -1 */
+  int be_numFastOpen;		/* connects with the request in the SYN */
+} Backend;
+
+#define BREAKER_CLOSED    0
+#define BREAKER_OPEN      1
+#define BREAKER_HALF_OPEN 2
+#define BREAKER_FAILURES  5	/* failed connects in a row to open */
+#define BREAKER_COOLDOWN  10	/* seconds open before a trial */
+#define CONNECT_TIMEOUT   5	/* seconds, then it counts as failed */
+static const char *breakerNames[] = {"closed", "open", "half-open"};
+static int numConnecting;
+
+/* optional health probes, a connect or a GET, every so often. a
+   backend that fails PROBE_FALLS in a row is out of rotation until
+   one passes */
+#define PROBE_NONE 0
+#define PROBE_TCP  1
+#define PROBE_HTTP 2
+#define PROBE_INTERVAL 10	/* default seconds between probes */
+#define PROBE_TIMEOUT  5
+#define PROBE_FALLS    2
+static int numProbing;
+
+/* optional pool of idle keep-alive connections to each backend. a
+   connection goes back once its response is over, if the request
+   and response both had a known length, and is closed after
+   sitting unused for a while */
+#define POOL_MAX  64		/* idle connections per backend */
+#define POOL_IDLE 4		/* default seconds, under most servers' own */
+static int numIdle;
+
+/* with -k, clients may send several requests on a connection, each
+   routed on its own, and wait this long between them */
+#define KEEPALIVE_IDLE 15
+static int clientKeepAlive;
+
+/* a request with Upgrade becomes a raw tunnel if the backend says
+   101. tunnels are closed when idle, and each slice only gets so
+   many at once */
+#define TUNNEL_IDLE 300		/* default seconds */
+#define TUNNEL_MAX (SERVICE_MAX/4) /* per slice, unless set otherwise */
+static int numTunnels;
+
+/* with -s, a second listener takes TLS and routes it by the server
+   name in the ClientHello, to services marked "tls". nothing is
+   decrypted, the stream goes through as it is */
+#define TLS_PORT 443
+#define TLS_ROUTE_KEY "!tls"	/* in the path trie, never a path */
+static int tlsLisSock = -1;
+
+/* TCP Fast Open. with -f, clients holding a cookie can put their
+   request in the SYN, and "fastopen" has connects to a service's
+   backends do the same */
+#define TFO_QLEN 256		/* fast opens pending on each listener */
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+static int listenFastOpen;
+static int numFastOpenAccepts;
+
+/* named sets of socket options, from "%sockopts" lines. a service
+   with "sockopts=<name>" gets them on its client and backend
+   sockets. zero means leave the kernel default */
+typedef struct SockProfile {
+  char *sp_line;		/* conf line it was made from */
+  char *sp_name;
+  int sp_noDelay;
+  int sp_cork;
+  int sp_sndBuf;
+  int sp_rcvBuf;
+  int sp_notSentLowat;
+  char sp_cc[16];		/* congestion control, "" for default */
+} SockProfile;
+
+/* when the loop itself falls behind, load is shed in steps: new
+   connections get a canned 503, then aren't accepted at all, then
+   low priority slices are refused. the lag is how long a pass of the
+   loop takes, smoothed, and the steps come from the "%shed" line */
+#define SHED_REJECT 1
+#define SHED_DEFER  2
+#define SHED_REFUSE 3
+#define SHED_LEVELS 3
+static int loopLagUs;		/* smoothed time a pass takes */
+static int loopReady;		/* smoothed ready fds a pass */
+static int shedLevel;
+static int numShedRejects;
+static int numShedDeferrals;	/* passes that skipped accepting */
+
+/* a "%slice" line, giving a slice's weight and its min and max
+   connections */
+typedef struct SliceConf {
+  char *sc_line;
+  char *sc_name;
+  int sc_weight;
+  int sc_minConns;
+  int sc_maxConns;		/* 0 if none */
+  int sc_rate;			/* bytes per second, 0 if unlimited */
+  int sc_connRate;		/* the same, for each connection */
+  int sc_queueMax;		/* requests that may wait, 0 for none */
+  int sc_queueWait;		/* seconds they may wait */
+  int sc_low;			/* refused first when we're overloaded */
+} SliceConf;
+
+/* clients by address, for the limits on the "%client" line. a table
+   of fixed size, where an address can only be in the CLIENT_PROBE_MAX
+   slots after its hash. a slot that has no connections and has seen
+   no connects for two windows is free to reuse. when there's none,
+   the address just isn't limited */
+#define CLIENT_TABLE_SIZE 8192
+#define CLIENT_PROBE_MAX  16
+#define CLIENT_WINDOW     10	/* seconds */
+typedef struct ClientEntry {
+  in_addr_t ce_addr;
+  int ce_conns;			/* open now */
+  int ce_window;		/* start of the current window */
+  int ce_cur;			/* connects in the current window */
+  int ce_prev;			/* and in the one before */
+} ClientEntry;
+static ClientEntry *clients;
+static int numClientRejects;
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+#define BALANCE_LEASTCONN 0	/* fewest connections per weight */
+#define BALANCE_RR        1	/* weighted round robin */
+#define BALANCE_HASH_URL  2	/* consistent hash of host and URL */
+#define BALANCE_HASH_IP   3	/* consistent hash of client address */
+
+/* points on the hash ring. each backend gets RING_VNODES points per
+   unit of weight, so adding or removing one only moves its share */
+typedef struct RingPoint {
+  unsigned int rp_hash;
+  int rp_backend;
+} RingPoint;
+#define RING_VNODES 64
+#define BACKEND_WEIGHT_MAX 1000
+
 typedef struct ServiceSig {
+  int ss_refs;			/* conf tables and connections using it */
+  char *ss_line;		/* conf line it was made from */
+  unsigned int ss_lineHash;
+  int ss_gen;			/* last reload that kept it */
+  SnapMap *ss_map;		/* if set, strings point into this */
   char *ss_host;		/* suffix in host */
   char *ss_slice;
-  short ss_port;
-  char *ss_ip;
+  Backend *ss_backends;		/* always allocated, even from a snapshot */
+  int ss_numBackends;
+  int ss_balance;
+  int ss_nextBackend;		/* where the least-conn scan starts */
+  RingPoint *ss_ring;		/* sorted, only for the hash policies */
+  int ss_ringSize;
+  int ss_probe;			/* PROBE_* */
+  char *ss_probePath;		/* for PROBE_HTTP */
+  int ss_probeInterval;
+  int ss_poolSize;		/* idle connections kept per backend */
+  int ss_poolIdle;		/* seconds before they're closed */
+  int ss_tunnelIdle;
+  char *ss_prefix;		/* URL path prefix, NULL if host-only */
+  int ss_strip;			/* strip prefix before passing it on? */
+  int ss_tls;			/* routed by SNI from the TLS listener */
+  int ss_fastOpen;		/* fast open to its backends */
+  char *ss_sockOpts;		/* profile name, or NULL */
+  int ss_profile;		/* in curConf's profiles, or -1 */
   int ss_slicePos;		/* position in slices array */
 } ServiceSig;
 
-static ServiceSig *serviceSig;
-static int numServices;
-static int confFileReadTime;
+/* everything loaded from the conf file. a reload builds a new table
+   off to the side and swaps it in. services are shared between the
+   old and new tables when their conf line didn't change, so only the
+   difference gets parsed, and connections hold their own reference
+   to the service they use. the control socket edits the current
+   table in place, leaving holes where services were removed */
+typedef struct ConfTable {
+  ServiceSig **ct_services;	/* in conf file order, NULL if removed */
+  int ct_numServices;		/* including holes */
+  int ct_numAlloc;
+  int ct_numHoles;
+  int ct_numShadowed;		/* duplicate rules not in the index */
+  ServiceSig **ct_lines;	/* open hash of services by conf line */
+  int ct_linesSize;
+  int ct_linesUsed;
+  RadixTree ct_index;		/* reversed host suffixes map to the root
+				   of a path prefix trie, whose values
+				   are service indices */
+  int ct_hostRoot;
+  SnapMap *ct_map;		/* if set, the index points into this */
+  SockProfile *ct_profiles;
+  int ct_numProfiles;
+  SliceConf *ct_sliceConfs;
+  int ct_numSliceConfs;
+  char *ct_clientLine;		/* the "%client" line, if any */
+  int ct_clientConns;		/* per address, 0 if no limit */
+  int ct_clientRate;		/* connects per CLIENT_WINDOW, 0 if any */
+  char *ct_shedLine;		/* the "%shed" line, if any */
+  int ct_shedLag[SHED_LEVELS];	/* ms of loop lag for each level */
+  int ct_shedReady;		/* ready fds a pass that mean reject */
+} ConfTable;
+
+static ConfTable *curConf;
+static int confGen;		/* bumped on every reload */
+#define MAX_HOST_LEN 256
+
+static int compileOnly;		/* -c: never load a snapshot */
+
+/* precompiled conf file, written by "codemux -c". all offsets are
+   from the start of the file, string offsets are into the string
+   table, and -1 means NULL */
+#define SNAP_MAGIC 0x584d4443	/* "CDMX" */
+#define SNAP_VERSION 14
+#define SNAP_ALIGN(x) (((x) + 7) & ~7)
+
+typedef struct SnapHeader {
+  unsigned int sh_magic;
+  unsigned int sh_version;
+  unsigned int sh_size;		/* whole file */
+  unsigned int sh_checksum;	/* of everything after the header */
+  long long sh_confMtime;	/* conf file this was built from */
+  long long sh_confMtimeNsec;
+  long long sh_confSize;
+  int sh_netflowName;		/* string offset */
+  int sh_numServices;
+  int sh_servicesOff;		/* SnapService array */
+  int sh_numBackends;
+  int sh_backendsOff;		/* SnapBackend array */
+  int sh_numSlices;
+  int sh_slicesOff;		/* array of string offsets */
+  int sh_numNodes;
+  int sh_nodesOff;		/* RadixNode array */
+  int sh_labelsLen;
+  int sh_labelsOff;
+  int sh_hostRoot;
+  int sh_stringsLen;
+  int sh_stringsOff;
+  int sh_numOptLines;
+  int sh_optLinesOff;		/* string offsets of the sockopts, slice,
+				   client and shed lines */
+} SnapHeader;
+
+typedef struct SnapService {
+  int sv_line;
+  int sv_host;
+  int sv_slice;
+  int sv_prefix;
+  int sv_backends;		/* first entry in the backend array */
+  int sv_numBackends;
+  int sv_balance;
+  int sv_strip;
+  int sv_probe;
+  int sv_probePath;
+  int sv_probeInterval;
+  int sv_poolSize;
+  int sv_poolIdle;
+  int sv_tunnelIdle;
+  int sv_tls;
+  int sv_fastOpen;
+  int sv_sockOpts;
+  int sv_slicePos;		/* index into the snapshot's slice table */
+} SnapService;
+
+typedef struct SnapBackend {
+  unsigned int sb_addr;		/* network order */
+  int sb_port;
+  int sb_path;			/* string offset, for a UNIX socket */
+  int sb_host;			/* string offset, for a named backend */
+  int sb_weight;
+} SnapBackend;
+static struct stat confFileStat;	/* conf file we last read */
+
+/* inotify on the conf dir and on /etc for the passwd file. events
+   just set flags, and the main loop acts on them once per pass */
+static int confWatchFd = -1;
+static int confWatchWd = -1;
+static int passwdWatchWd = -1;
+static int confEvents;
+#define CONF_EV_CONF   0x01	/* codemux.conf changed */
+#define CONF_EV_SNAP   0x02	/* codemux.snap changed */
+#define CONF_EV_PASSWD 0x04	/* /etc/passwd changed */
 static int now;
 
+/* local control connections. commands are single lines, and each
+   gets one reply line starting with OK or ERR */
+typedef struct CtlConn {
+  int cc_fd;
+  char cc_in[1024];		/* partial command line */
+  int cc_inUsed;
+  StrBuf cc_out;		/* replies not yet written */
+  int cc_outStart;
+  int cc_eof;			/* close once the replies are out */
+} CtlConn;
+#define MAX_CTL_CONNS 8
+#define CTL_OUT_MAX (4 * 1024 * 1024)
+static int ctlLisSock = -1;
+static CtlConn *ctlConns[MAX_CTL_CONNS];
+
 typedef struct SliceInfo {
-  char *si_sliceName;
+  char *si_sliceName;		/* NULL if this slot is free */
   int si_inUse;			/* do any services refer to this? */
   int si_numConns;
   int si_xid;
+  int si_refs;			/* live services pointing here */
+  int si_nextFree;		/* free list link */
+  int si_maxConns;		/* from the conf or the control socket,
+				   0 if none */
+  int si_minConns;		/* never held back below this many */
+  int si_weight;		/* of its fair share, 1 by default */
+  int si_share;			/* fair share, while it's active */
+  int si_activePos;		/* in activeSlices, while it's active */
+  int si_rate;			/* bytes per second relayed, 0 if any */
+  int si_connRate;		/* the same, for each connection */
+  int si_tokens;		/* bytes it may still relay */
+  int si_queueMax;		/* requests that may wait for a slot */
+  int si_queueWait;		/* seconds they may wait */
+  int si_queueHead;		/* fd plus one, or 0 */
+  int si_queueTail;
+  int si_queueLen;
+  int si_low;			/* refused first when we're overloaded */
+  int si_numTunnels;
+  int si_maxTunnels;		/* 0 for TUNNEL_MAX */
+  unsigned int si_nameHash;
 } SliceInfo;
 
 static SliceInfo *slices;
-static int numSlices;
+static int numSlices;		/* slots used, including free ones */
+static int freeSlicePos = -1;	/* head of the free slot list */
+static int *sliceIndex;		/* open hash of slice positions by name */
+static int sliceIndexSize;
+static int sliceIndexUsed;
+
+/* slice name to xid, from /etc/passwd. it's only read again when the
+   file changes, and the names point into its contents */
+typedef struct XidEntry {
+  char *xe_name;		/* NULL if the slot is empty */
+  unsigned int xe_hash;
+  int xe_xid;
+} XidEntry;
+static XidEntry *xidCache;
+static int xidCacheSize;
+static char *xidCacheData;
+static struct stat passwdStat;
 static int numActiveSlices;
 static int numTotalSliceConns;
+static int *activeSlices;	/* positions of slices with connections */
+static int activeSlicesAlloc;
+
+/* a request over its slice's limits can wait for a slot, if the
+   slice has a queue. it's routed already, so it just gets started
+   once there's room */
+#define QUEUE_WAIT 3		/* seconds, unless set otherwise */
+static int numQueued;
+static int numQueueDispatches;
+static int numQueueTimeouts;
+
+/* relayed bytes are metered by token buckets, per slice and per
+   connection. a bucket holds a quarter second of its rate, and never
+   less than a buffer, so a read is always possible once it's full.
+   while any socket waits for tokens the loop wakes every tick */
+#define SHAPE_TICK_MS 50
+#define SHAPE_DEPTH(rate) MAX((rate) / 4, FB_SIZE)
+static long long nowMs;		/* monotonic, for the buckets */
+static int anyShaping;		/* some slice has a rate */
+static int throttledCeiling;	/* above the highest throttled fd, which
+				   highestSetFd may not cover */
 static int anySliceXidsNeeded;
 
 typedef struct OurFDSet {
@@ -93,6 +522,20 @@ static OurFDSet masterReadSet, masterWriteSet;
 static int highestSetFd;
 static int numNeedingHeaders;	/* how many conns waiting on headers? */
 
+/* connections waiting on headers must keep up a minimum rate, which
+   rises with load: each header byte buys 1/rate seconds on top of a
+   grace period. they're kept in a heap by when they fall behind, so
+   the slowest are found without a scan. at level 0 nobody is closed,
+   but the heap is still ordered by the level 1 rule */
+#define HDR_LEVELS 4
+static const int hdrMinRate[HDR_LEVELS] = {8, 8, 32, 128}; /* bytes/sec */
+static const int hdrGrace[HDR_LEVELS] = {30, 30, 10, 5};   /* seconds */
+static int hdrLevel;
+static int hdrHeap[TARG_SETSIZE];	/* fds, soonest deadline first */
+static int hdrHeapLen;
+static int numSlowEvictions;	/* fell below the rate */
+static int numPressureEvictions; /* slowest, closed to make room */
+
 static int numForks;
 
 /* PLC netflow domain name like netflow.planet-lab.org */
@@ -103,812 +546,4562 @@ static char* domainNamePLCNetflow = NULL;
 #endif
 /*-----------------------------------------------------------------*/
 static SliceInfo *
-ServiceToSlice(int whichService)
+ServiceToSlice(ServiceSig *ss)
 {
-  if (whichService < 0)
+  if (ss == NULL)
     return(NULL);
-  return(&slices[serviceSig[whichService].ss_slicePos]);
+  return(&slices[ss->ss_slicePos]);
+}
+/*-----------------------------------------------------------------*/
+static int
+BackendPort(Backend *be)
+{
+  if (be->be_addr.ba_sa.sa_family != AF_INET)
+    return(0);
+  return(ntohs(be->be_addr.ba_in.sin_port));
 }
 /*-----------------------------------------------------------------*/
 static void
-DumpStatus(int fd)
+DumpStatus(StrBuf *sb)
 {
-  char buf[65535];
-  char *start = buf;
-  int i;
-  int len;
+  int i, j;
 
-  sprintf(start, 
-	  "CoDemux version %s\n"
-	  "numForks %d, numActiveSlices %d, numTotalSliceConns %d\n"
-	  "numNeedingHeaders %d, anySliceXidsNeeded %d\n",
-	  CODEMUX_VERSION,
-	  numForks, numActiveSlices, numTotalSliceConns,
-	  numNeedingHeaders, anySliceXidsNeeded);
-  start += strlen(start);
+  StrBufPrintf(sb, 
+	       "CoDemux version %s\n"
+	       "numForks %d, numActiveSlices %d, numTotalSliceConns %d\n"
+	       "numNeedingHeaders %d, anySliceXidsNeeded %d\n"
+	       "header level %d, numSlowEvictions %d, "
+	       "numPressureEvictions %d\n"
+	       "loop lag %d us, %d ready, shed level %d, "
+	       "numShedRejects %d, numShedDeferrals %d\n",
+	       CODEMUX_VERSION,
+	       numForks, numActiveSlices, numTotalSliceConns,
+	       numNeedingHeaders, anySliceXidsNeeded,
+	       hdrLevel, numSlowEvictions, numPressureEvictions,
+	       loopLagUs, loopReady, shedLevel, 
+	       numShedRejects, numShedDeferrals);
+  if (listenFastOpen)
+    StrBufPrintf(sb, "numFastOpenAccepts %d\n", numFastOpenAccepts);
+  if (curConf->ct_clientLine != NULL)
+    StrBufPrintf(sb, "numClientRejects %d\n", numClientRejects);
+  if (numQueued > 0 || numQueueDispatches > 0 || numQueueTimeouts > 0)
+    StrBufPrintf(sb, "numQueued %d, numQueueDispatches %d, "
+		 "numQueueTimeouts %d\n", 
+		 numQueued, numQueueDispatches, numQueueTimeouts);
 
   for (i = 0; i < numSlices; i++) {
     SliceInfo *si = &slices[i];
-    sprintf(start, "Slice %d: %s xid %d, %d conns, inUse %d\n", 
-	    i, si->si_sliceName, si->si_xid, si->si_numConns,
-	    si->si_inUse);
-    start += strlen(start);
+    if (si->si_sliceName == NULL)
+      continue;
+    StrBufPrintf(sb, "Slice %d: %s xid %d, %d conns, inUse %d", 
+		 i, si->si_sliceName, si->si_xid, si->si_numConns,
+		 si->si_inUse);
+    if (si->si_weight != 1)
+      StrBufPrintf(sb, ", weight %d", si->si_weight);
+    if (si->si_minConns > 0)
+      StrBufPrintf(sb, ", min %d", si->si_minConns);
+    if (si->si_maxConns > 0)
+      StrBufPrintf(sb, ", max %d", si->si_maxConns);
+    if (si->si_numConns > 0)
+      StrBufPrintf(sb, ", share %d", si->si_share);
+    if (si->si_rate > 0)
+      StrBufPrintf(sb, ", rate %d (%d left)", si->si_rate, si->si_tokens);
+    if (si->si_connRate > 0)
+      StrBufPrintf(sb, ", conn-rate %d", si->si_connRate);
+    if (si->si_queueMax > 0)
+      StrBufPrintf(sb, ", %d queued of %d", si->si_queueLen, 
+		   si->si_queueMax);
+    if (si->si_numTunnels > 0 || si->si_maxTunnels > 0)
+      StrBufPrintf(sb, ", %d tunnels of %d", si->si_numTunnels,
+		   si->si_maxTunnels > 0 ? si->si_maxTunnels : TUNNEL_MAX);
+    StrBufPrintf(sb, "\n");
   }
 
-  for (i = 0; i < numServices; i++) {
-    ServiceSig *ss = &serviceSig[i];
-    sprintf(start, "Service %d: %s %s port %d, slice# %d\n", i, ss->ss_host,
-	    ss->ss_slice, (int) ss->ss_port, ss->ss_slicePos);
-    start += strlen(start);
+  for (i = 0; i < curConf->ct_numServices; i++) {
+    ServiceSig *ss = curConf->ct_services[i];
+    if (ss == NULL)
+      continue;
+    StrBufPrintf(sb, "Service %d: %s%s %s port %d, slice# %d%s%s\n", i, 
+		 ss->ss_host, ss->ss_prefix ? ss->ss_prefix : "",
+		 ss->ss_slice, BackendPort(&ss->ss_backends[0]),
+		 ss->ss_slicePos, ss->ss_strip ? " strip" : "",
+		 ss->ss_tls ? " tls" : "");
+    for (j = 0; j < ss->ss_numBackends; j++) {
+      Backend *be = &ss->ss_backends[j];
+      StrBufPrintf(sb, "  Backend %d: %s weight %d, %d conns, "
+		   "breaker %s, opened %d, half-opened %d, closed %d", j,
+		   be->be_name, be->be_weight, 
+		   be->be_numConns, breakerNames[be->be_state],
+		   be->be_numOpened, be->be_numHalfOpened, be->be_numClosed);
+      if (ss->ss_probe != PROBE_NONE)
+	StrBufPrintf(sb, ", probe %s", be->be_healthy ? "up" : "down");
+      if (ss->ss_poolSize > 0)
+	StrBufPrintf(sb, ", %d idle, %d reused", 
+		     be->be_numIdle, be->be_numReused);
+      if (ss->ss_fastOpen)
+	StrBufPrintf(sb, ", %d fastopen", be->be_numFastOpen);
+      if (be->be_dns >= 0) {
+	struct in_addr addr;
+	StrBufPrintf(sb, ", %s", DnsLookup(be->be_dns, &addr) == SUCCESS ?
+		     inet_ntoa(addr) : "unresolved");
+      }
+      StrBufPrintf(sb, "\n");
+    }
   }
-
-  len = start - buf;
-  write(fd, buf, len);
 }
 /*-----------------------------------------------------------------*/
-static void
-GetSliceXids(void)
+static int
+SameFile(struct stat *a, struct stat *b)
 {
-  /* walks through /etc/passwd, and gets the uid for every slice we
-     have */
-  FILE *f;
-  char *line;
-  int i;
+  /* compares down to the nanosecond, so two writes within the same
+     second still look different */
+  return(a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	 a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	 a->st_mtim.tv_nsec == b->st_mtim.tv_nsec);
+}
+/*-----------------------------------------------------------------*/
+static int
+LookupXid(const char *name)
+{
+  /* returns 0 if passwd has no such account */
+  unsigned int hash;
+  int slot;
 
-  if (!anySliceXidsNeeded)
-    return;
+  if (xidCache == NULL)
+    return(0);
+  hash = HashBufferNoCase(name, strlen(name), 0);
+  for (slot = hash & (xidCacheSize - 1); xidCache[slot].xe_name != NULL;
+       slot = (slot + 1) & (xidCacheSize - 1)) {
+    if (xidCache[slot].xe_hash == hash &&
+	strcasecmp(xidCache[slot].xe_name, name) == 0)
+      return(xidCache[slot].xe_xid);
+  }
+  return(0);
+}
+/*-----------------------------------------------------------------*/
+static int
+LoadXidCache(void)
+{
+  /* reads /etc/passwd in one go if it changed, returns TRUE if so */
+  struct stat statBuf;
+  XidEntry *cache;
+  char *data, *line, *next;
+  int fd, len, res, size;
+  int numLines = 0;
 
-  for (i = 0; i < numSlices; i++) {
-    SliceInfo *si = &slices[i];
-    si->si_inUse = 0;
+  if (stat("/etc/passwd", &statBuf) != 0)
+    return(FALSE);
+  if (xidCache != NULL && SameFile(&statBuf, &passwdStat))
+    return(FALSE);
+  if ((fd = open("/etc/passwd", O_RDONLY)) < 0)
+    return(FALSE);
+  data = xmalloc(statBuf.st_size + 1);
+  for (len = 0; len < statBuf.st_size; len += res) {
+    if ((res = read(fd, &data[len], statBuf.st_size - len)) <= 0)
+      break;
   }
-  for (i = 0; i < numServices; i++) {
-    SliceInfo *si = ServiceToSlice(i);
-    if (si != NULL)
-      si->si_inUse++;
-  }  
+  close(fd);
+  data[len] = '\0';
 
-  if ((f = fopen("/etc/passwd", "r")) == NULL)
-    return;
+  for (line = data; (line = strchr(line, '\n')) != NULL; line++)
+    numLines++;
+  for (size = 16; size < (numLines + 1) * 2; size *= 2)
+    ;
+  cache = xcalloc(size, sizeof(XidEntry));
 
-  while ((line = GetNextLine(f)) != NULL) {
+  for (line = data; *line != '\0'; line = next) {
     char *temp;
-    int xid;
+    unsigned int hash;
+    int xid, slot;
+
+    if ((next = strchr(line, '\n')) != NULL)
+      *next++ = '\0';
+    else
+      next = line + strlen(line);
 
     if ((temp = strchr(line, ':')) == NULL)
-      goto next_line;			/* weird line */
+      continue;			/* weird line */
     *temp = '\0';		/* terminate slice name */
     temp++;
-    if ((temp = strchr(temp+1, ':')) == NULL)
-      goto next_line;	/* weird line */
+    if ((temp = strchr(temp, ':')) == NULL)
+      continue;			/* weird line */
     if ((xid = atoi(temp+1)) < 1)
-      goto next_line;	/* weird xid */
-    
-    /* we've got a slice name and xid, let's try to match */
-    for (i = 0; i < numSlices; i++) {
-      if (slices[i].si_xid == 0 &&
-	  strcasecmp(slices[i].si_sliceName, line) == 0) {
-	slices[i].si_xid = xid;
+      continue;			/* weird xid */
+
+    /* the first line for a name wins */
+    hash = HashBufferNoCase(line, strlen(line), 0);
+    for (slot = hash & (size - 1); cache[slot].xe_name != NULL;
+	 slot = (slot + 1) & (size - 1)) {
+      if (cache[slot].xe_hash == hash &&
+	  strcasecmp(cache[slot].xe_name, line) == 0)
 	break;
-      }
     }
-  next_line:
-    if (line)
-      xfree(line);
+    if (cache[slot].xe_name == NULL) {
+      cache[slot].xe_name = line;
+      cache[slot].xe_hash = hash;
+      cache[slot].xe_xid = xid;
+    }
+  }
+
+  if (xidCache != NULL) {
+    xfree(xidCache);
+    xfree(xidCacheData);
   }
+  xidCache = cache;
+  xidCacheSize = size;
+  xidCacheData = data;
+  passwdStat = statBuf;
+  return(TRUE);
+}
+/*-----------------------------------------------------------------*/
+static void
+GetSliceXids(void)
+{
+  /* gets the uid for every slice that needs one. passwd is only
+     read again when it changed, and then every slice is checked in
+     case its account changed too */
+  int changed;
+  int i;
+
+  changed = LoadXidCache();
+  if (!anySliceXidsNeeded && !changed)
+    return;
+
+  for (i = 0; i < numSlices; i++)
+    slices[i].si_inUse = 0;
+  for (i = 0; i < curConf->ct_numServices; i++) {
+    SliceInfo *si = ServiceToSlice(curConf->ct_services[i]);
+    if (si != NULL)
+      si->si_inUse++;
+  }  
 
   /* assume service 0 is the root service, and don't check it since
      it'll have xid zero */
   anySliceXidsNeeded = FALSE;
-  for (i = 1; i < numSlices; i++) {
-    if (slices[i].si_xid == 0 && slices[i].si_inUse > 0) {
+  for (i = 0; i < numSlices; i++) {
+    SliceInfo *si = &slices[i];
+    int xid;
+
+    if (si->si_sliceName == NULL)
+      continue;
+    if ((si->si_xid == 0 || changed) &&
+	(xid = LookupXid(si->si_sliceName)) > 0)
+      si->si_xid = xid;
+    if (i > 0 && si->si_xid == 0 && si->si_inUse > 0)
       anySliceXidsNeeded = TRUE;
-      break;
-    }
   }
+}
+/*-----------------------------------------------------------------*/
+static int
+SlicePlain(SliceInfo *si)
+{
+  /* no weight, min or max of its own */
+  return(si->si_weight == 1 && si->si_minConns == 0 && 
+	 si->si_maxConns == 0);
+}
+/*-----------------------------------------------------------------*/
+static int
+SliceShareAt(SliceInfo *si, double level)
+{
+  /* what the slice gets when each unit of weight gets level */
+  int lo = si->si_minConns;
+  int hi = (si->si_maxConns > 0) ? MIN(si->si_maxConns, MAX_CONNS) : 
+    SERVICE_MAX;
+  double share = si->si_weight * level;
 
-  fclose(f);
+  if (lo > hi)
+    lo = hi;
+  if (share < lo)
+    return(lo);
+  if (share > hi)
+    return(hi);
+  return((int) share);
+}
+/*-----------------------------------------------------------------*/
+static void
+ComputeShares(void)
+{
+  /* weighted max-min fairness among the active slices: find the
+     level per unit of weight at which the shares, each held between
+     its slice's min and max, add up to MAX_CONNS. what a capped slice
+     can't use goes to the others. run whenever a slice goes active
+     or idle, or limits change, so admission only compares. if no
+     active slice has limits of its own, it's just an even split */
+  double lo = 0, hi = MAX_CONNS;
+  int i, iter, total, allPlain = TRUE;
+
+  if (numActiveSlices == 0)
+    return;
+  for (i = 0; i < numActiveSlices; i++) {
+    if (!SlicePlain(&slices[activeSlices[i]]))
+      allPlain = FALSE;
+  }
+  if (allPlain) {
+    int share = MIN(SERVICE_MAX, MAX_CONNS / numActiveSlices);
+    for (i = 0; i < numActiveSlices; i++)
+      slices[activeSlices[i]].si_share = share;
+    return;
+  }
+
+  for (iter = 0; iter < 32; iter++) {
+    double mid = (lo + hi) / 2;
+
+    total = 0;
+    for (i = 0; i < numActiveSlices; i++)
+      total += SliceShareAt(&slices[activeSlices[i]], mid);
+    if (total > MAX_CONNS)
+      hi = mid;
+    else
+      lo = mid;
+  }
+  for (i = 0; i < numActiveSlices; i++) {
+    SliceInfo *si = &slices[activeSlices[i]];
+    si->si_share = MAX(1, SliceShareAt(si, lo));
+  }
 }
 /*-----------------------------------------------------------------*/
 static void
-SliceConnsInc(int whichService)
+SliceConnsInc(ServiceSig *ss)
 {
-  SliceInfo *si = ServiceToSlice(whichService);
+  SliceInfo *si = ServiceToSlice(ss);
 
   if (si == NULL)
     return;
   numTotalSliceConns++;
   si->si_numConns++;
-  if (si->si_numConns == 1)
-    numActiveSlices++;
+  if (si->si_numConns == 1) {
+    if (numActiveSlices >= activeSlicesAlloc) {
+      activeSlicesAlloc = MAX(8, activeSlicesAlloc * 2);
+      activeSlices = xrealloc(activeSlices, 
+			      activeSlicesAlloc * sizeof(int));
+    }
+    si->si_activePos = numActiveSlices;
+    activeSlices[numActiveSlices++] = si - slices;
+    ComputeShares();
+  }
 }
 /*-----------------------------------------------------------------*/
 static void
-SliceConnsDec(int whichService)
+SliceConnsDec(ServiceSig *ss)
 {
-  SliceInfo *si = ServiceToSlice(whichService);
+  SliceInfo *si = ServiceToSlice(ss);
 
   if (si == NULL)
     return;
   numTotalSliceConns--;
   si->si_numConns--;
-  if (si->si_numConns == 0)
-    numActiveSlices--;
+  if (si->si_numConns == 0) {
+    /* the last active slice takes its place in the list */
+    int last = activeSlices[--numActiveSlices];
+    activeSlices[si->si_activePos] = last;
+    slices[last].si_activePos = si->si_activePos;
+    ComputeShares();
+  }
 }
 /*-----------------------------------------------------------------*/
-static int
-WhichSlicePos(char *slice)
+static void
+SliceIndexAdd(int pos)
 {
-  /* adds the new slice if necessary, returns the index into slice
-     array. Never change the ordering of existing slices */
-  int i;
-  static int numSlicesAlloc;
+  int slot;
 
-  for (i = 0; i < numSlices; i++) {
-    if (strcasecmp(slice, slices[i].si_sliceName) == 0)
-      return(i);
-  }
+  if ((sliceIndexUsed + 1) * 2 > sliceIndexSize) {
+    int i;
 
-  if (numSlices >= numSlicesAlloc) {
-    numSlicesAlloc = MAX(8, numSlicesAlloc * 2);
-    slices = xrealloc(slices, numSlicesAlloc * sizeof(SliceInfo));
+    sliceIndexSize = MAX(16, sliceIndexSize * 2);
+    if (sliceIndex != NULL)
+      xfree(sliceIndex);
+    sliceIndex = xmalloc(sliceIndexSize * sizeof(int));
+    for (i = 0; i < sliceIndexSize; i++)
+      sliceIndex[i] = -1;
+    sliceIndexUsed = 0;
+    for (i = 0; i < numSlices; i++) {
+      if (i != pos && slices[i].si_sliceName != NULL)
+	SliceIndexAdd(i);
+    }
   }
-
-  memset(&slices[numSlices], 0, sizeof(SliceInfo));
-  slices[numSlices].si_sliceName = xstrdup(slice);
-  numSlices++;
-  return(numSlices-1);
+  slot = slices[pos].si_nameHash & (sliceIndexSize - 1);
+  while (sliceIndex[slot] >= 0)
+    slot = (slot + 1) & (sliceIndexSize - 1);
+  sliceIndex[slot] = pos;
+  sliceIndexUsed++;
 }
 /*-----------------------------------------------------------------*/
 static void
-ReadConfFile(void)
+SliceIndexRemove(int pos)
 {
-  int numAlloc = 0;
-  int num = 0;
-  ServiceSig *servs = NULL;
-  FILE *f;
-  char *line = NULL;
-  struct stat statBuf;
-  int i;
+  int mask = sliceIndexSize - 1;
+  int slot;
 
-  if (stat(CONF_FILE, &statBuf) != 0) {
-    fprintf(stderr, "failed stat on codemux.conf\n");
-    if (numServices)
+  for (slot = slices[pos].si_nameHash & mask; sliceIndex[slot] != pos;
+       slot = (slot + 1) & mask) {
+    if (sliceIndex[slot] < 0)
       return;
-    exit(-1);
   }
-  if (statBuf.st_mtime == confFileReadTime)
-    return;
+  sliceIndex[slot] = -1;
+  sliceIndexUsed--;
 
-  if ((f = fopen(CONF_FILE, "r")) == NULL) {
-    fprintf(stderr, "failed reading codemux.conf\n");
-    if (numServices)
-      return;
-    exit(-1);
+  /* rehash the rest of the run, so nothing after the gap is lost */
+  for (slot = (slot + 1) & mask; sliceIndex[slot] >= 0;
+       slot = (slot + 1) & mask) {
+    int move = sliceIndex[slot];
+    sliceIndex[slot] = -1;
+    sliceIndexUsed--;
+    SliceIndexAdd(move);
   }
+}
+/*-----------------------------------------------------------------*/
+static int
+FindSlicePos(const char *slice)
+{
+  /* returns the index into slice array, or -1 if we don't have it */
+  unsigned int hash;
+  int slot;
 
-  /* conf file entries look like
-     coblitz.codeen.org princeton_coblitz 3125
-  */
-
-  while (1) {
-    ServiceSig serv;
-    int port;
-    if (line != NULL)
-      xfree(line);
-    
-    if ((line = GetNextLine(f)) == NULL)
-      break;
-
-    memset(&serv, 0, sizeof(serv));
-    if (WordCount(line) < 3) {
-      fprintf(stderr, "bad line: %s\n", line);
-      continue;
-    }
-    serv.ss_port = port = atoi(GetField(line, 2));
-    if (port < 1 || port > 65535 || port == DEMUX_PORT) {
-      fprintf(stderr, "bad port: %s\n", line);
-      continue;
-    }
-
-    serv.ss_host = GetWord(line, 0);
-    serv.ss_slice = GetWord(line, 1);
-    serv.ss_ip = GetWord(line, 3);
-
-    if (num == 0) {
-      /* the first row must be an entry for apache */
-      if (strcmp(serv.ss_host, "*") != 0 ||
-	  strcmp(serv.ss_slice, "root") != 0) {
-	fprintf(stderr, "first row has to be for webserver\n");
-	exit(-1);
-      }
-      /* see if there's PLC netflow's domain name */
-      if (domainNamePLCNetflow != NULL) {
-	xfree(domainNamePLCNetflow);
-	domainNamePLCNetflow = NULL;
-      }
-      domainNamePLCNetflow = GetWord(line, 3);
-    }
-    if (num >= numAlloc) {
-      numAlloc = MAX(numAlloc * 2, 8);
-      servs = xrealloc(servs, numAlloc * sizeof(ServiceSig));
-    }
-    serv.ss_slicePos = WhichSlicePos(serv.ss_slice);
-    if (slices[serv.ss_slicePos].si_inUse == 0 &&
-	slices[serv.ss_slicePos].si_xid < 1)
-      anySliceXidsNeeded = TRUE; /* if new/inactive, we need xid */
-    servs[num] = serv;
-    num++;
+  if (sliceIndex == NULL)
+    return(-1);
+  hash = HashBufferNoCase(slice, strlen(slice), 0);
+  for (slot = hash & (sliceIndexSize - 1); sliceIndex[slot] >= 0;
+       slot = (slot + 1) & (sliceIndexSize - 1)) {
+    SliceInfo *si = &slices[sliceIndex[slot]];
+    if (si->si_nameHash == hash && strcasecmp(slice, si->si_sliceName) == 0)
+      return(sliceIndex[slot]);
   }
+  return(-1);
+}
+/*-----------------------------------------------------------------*/
+static int
+WhichSlicePos(char *slice)
+{
+  /* adds the new slice if necessary, returns the index into slice
+     array. Never change the ordering of existing slices, but reuse
+     the slots of slices that are gone */
+  int i;
+  static int numSlicesAlloc;
 
-  fclose(f);
+  if ((i = FindSlicePos(slice)) >= 0)
+    return(i);
 
-#if 0
-  /* Faiyaz asked me to allow a single-entry codemux conf */
-  if (num == 1) {
-    if (numServices == 0) {
-      fprintf(stderr, "nothing found in codemux.conf\n");
-      exit(-1);
-    }
-    return;
+  if (freeSlicePos >= 0) {
+    i = freeSlicePos;
+    freeSlicePos = slices[i].si_nextFree;
   }
-#endif
-  if (num < 1) {
-    fprintf(stderr, "no entry found in codemux.conf\n");
-    exit(-1);
+  else {
+    if (numSlices >= numSlicesAlloc) {
+      numSlicesAlloc = MAX(8, numSlicesAlloc * 2);
+      slices = xrealloc(slices, numSlicesAlloc * sizeof(SliceInfo));
+    }
+    i = numSlices++;
   }
 
-  for (i = 0; i < numServices; i++) {
-    xfree(serviceSig[i].ss_host);
-    xfree(serviceSig[i].ss_ip);
-    xfree(serviceSig[i].ss_slice);
-  }
-  xfree(serviceSig);
-  serviceSig = servs;
-  numServices = num;
-  confFileReadTime = statBuf.st_mtime;
+  memset(&slices[i], 0, sizeof(SliceInfo));
+  slices[i].si_weight = 1;
+  slices[i].si_sliceName = xstrdup(slice);
+  slices[i].si_nameHash = HashBufferNoCase(slice, strlen(slice), 0);
+  slices[i].si_xid = LookupXid(slice);
+  SliceIndexAdd(i);
+  return(i);
 }
 /*-----------------------------------------------------------------*/
-static char *err400BadRequest =
-"HTTP/1.0 400 Bad Request\r\n"
-"Content-Type: text/html\r\n"
-"\r\n"
-"You are trying to access a PlanetLab node, and your\n"
-"request header exceeded the allowable size. Please\n"
-"try again if you believe this error is temporary.\n";
-/*-----------------------------------------------------------------*/
-static char *err503Unavailable =
-"HTTP/1.0 503 Service Unavailable\r\n"
-"Content-Type: text/html\r\n"
-"\r\n"
-"You are trying to access a PlanetLab node, but the service\n"
-"seems to be unavailable at the moment. Please try again.\n";
-/*-----------------------------------------------------------------*/
-static char *err503TooBusy =
-"HTTP/1.0 503 Service Unavailable\r\n"
-"Content-Type: text/html\r\n"
-"\r\n"
-"You are trying to access a PlanetLab node, but the service\n"
-"seems to be overloaded at the moment. Please try again.\n";
-/*-----------------------------------------------------------------*/
-static void
-SetFd(int fd, OurFDSet *set)
+static int
+SliceRef(char *slice, int hint)
 {
-  if (highestSetFd < fd)
-    highestSetFd = fd;
-  FD_SET(fd, set);
+  /* like WhichSlicePos, but takes a reference for a service. hint
+     is where the caller expects the slice to be, or -1 */
+  int pos;
+
+  if (hint >= 0 && hint < numSlices && slices[hint].si_sliceName != NULL &&
+      strcasecmp(slices[hint].si_sliceName, slice) == 0)
+    pos = hint;
+  else
+    pos = WhichSlicePos(slice);
+  slices[pos].si_refs++;
+  return(pos);
 }
 /*-----------------------------------------------------------------*/
 static void
-ClearFd(int fd, OurFDSet *set)
+SliceRelease(int pos)
 {
-  FD_CLR(fd, set);
+  /* once no service refers to a slice, none of its connections can
+     be left either, and its slot can go */
+  SliceInfo *si = &slices[pos];
+
+  if (--si->si_refs > 0)
+    return;
+  SliceIndexRemove(pos);
+  xfree(si->si_sliceName);
+  si->si_sliceName = NULL;
+  si->si_inUse = 0;
+  si->si_nextFree = freeSlicePos;
+  freeSlicePos = pos;
 }
 /*-----------------------------------------------------------------*/
 static int
-RemoveHeader(char *lower, char *real, int totalSize, char *header)
+ReverseHost(const char *host, int len, char *dest)
 {
-  /* returns number of characters removed */
-  char h2[256];
-  int start, end, len;
-  char *temp, *conn;
-
-  sprintf(h2, "\n%s", header);
+  /* writes the host backwards into dest, ignoring any trailing dots,
+     so that suffix matches become prefix matches. "*" means any host,
+     and becomes the empty key. returns the key length, or -1 if the
+     host is too long */
+  int i;
 
-  if ((conn = strstr(lower, h2)) == NULL)
+  if (len == 1 && host[0] == '*')
     return(0);
-
-  conn++;
-  /* determine how many characters to remove */
-  if ((temp = strchr(conn, '\n')) != NULL)
-    len = (temp - conn) + 1;
-  else
-    len = strlen(conn) + 1;
-  start = conn - lower;
-  end = start + len;
-  memmove(&real[start], &real[end], totalSize - end);
-  memmove(&lower[start], &lower[end], totalSize - end);
-
+  while (len > 1 && host[len-1] == '.')
+    len--;
+  if (len > MAX_HOST_LEN)
+    return(-1);
+  for (i = 0; i < len; i++)
+    dest[i] = tolower(host[len - 1 - i]);
   return(len);
 }
 /*-----------------------------------------------------------------*/
 static int
-InsertHeader(char *buf, int totalSize, char *header)
+RouteIndexFindPath(ConfTable *ct, const char *host, int create)
+{
+  /* returns the root of the host's path trie, or RADIX_NONE */
+  char key[MAX_HOST_LEN];
+  RadixTree *rt = &ct->ct_index;
+  int keyLen, pathRoot;
+
+  if ((keyLen = ReverseHost(host, strlen(host), key)) < 0)
+    return(RADIX_NONE);
+  if ((pathRoot = RadixFind(rt, ct->ct_hostRoot, 
+			    key, keyLen)) == RADIX_NONE && create) {
+    pathRoot = RadixNewRoot(rt);
+    RadixInsert(rt, ct->ct_hostRoot, key, keyLen, pathRoot);
+  }
+  return(pathRoot);
+}
+/*-----------------------------------------------------------------*/
+static const char *
+RouteKey(ServiceSig *ss)
+{
+  /* where the service goes in its host's path trie. TLS services
+     have no path, and use a key that no request path starts with */
+  if (ss->ss_tls)
+    return(TLS_ROUTE_KEY);
+  return(ss->ss_prefix ? ss->ss_prefix : "");
+}
+/*-----------------------------------------------------------------*/
+static void
+RouteIndexAdd(ConfTable *ct, int whichService)
+{
+  RadixTree *rt = &ct->ct_index;
+  ServiceSig *ss = ct->ct_services[whichService];
+  const char *prefix = RouteKey(ss);
+  int pathRoot, old;
+
+  if ((pathRoot = RouteIndexFindPath(ct, ss->ss_host, TRUE)) == RADIX_NONE) {
+    fprintf(stderr, "host too long: %s\n", ss->ss_host);
+    return;
+  }
+  old = RadixInsert(rt, pathRoot, prefix, strlen(prefix), whichService);
+  if (old != RADIX_NONE && old < whichService) {
+    /* the earlier line wins, like it always has */
+    RadixInsert(rt, pathRoot, prefix, strlen(prefix), old);
+    ct->ct_numShadowed++;
+    fprintf(stderr, "duplicate rule ignored: %s%s\n", ss->ss_host, prefix);
+  }
+}
+/*-----------------------------------------------------------------*/
+static int
+RouteIndexFind(ConfTable *ct, const char *host, const char *prefix)
+{
+  /* finds the service routed for exactly this host and prefix */
+  ServiceSig *root = ct->ct_services[0];
+  int pathRoot;
+
+  if (prefix != NULL && prefix[0] == '\0')
+    prefix = NULL;
+  if (strcasecmp(host, root->ss_host) == 0 &&
+      ((prefix == NULL && root->ss_prefix == NULL) ||
+       (prefix != NULL && root->ss_prefix != NULL &&
+	strcmp(prefix, root->ss_prefix) == 0)))
+    return(0);
+  if ((pathRoot = RouteIndexFindPath(ct, host, FALSE)) == RADIX_NONE)
+    return(RADIX_NONE);
+  if (prefix == NULL)
+    prefix = "";
+  return(RadixFind(&ct->ct_index, pathRoot, prefix, strlen(prefix)));
+}
+/*-----------------------------------------------------------------*/
+static void
+BuildRouteIndex(ConfTable *ct)
+{
+  /* the host trie holds every configured host suffix once, and each
+     host has its own path trie. a host-only rule is just the empty
+     path prefix, so a single walk of both tries finds every rule
+     that matches a request */
+  int i;
+
+  RadixInit(&ct->ct_index);
+  ct->ct_hostRoot = RadixNewRoot(&ct->ct_index);
+  ct->ct_numShadowed = 0;
+
+  /* service 0 is the default, and is never matched by host */
+  for (i = 1; i < ct->ct_numServices; i++) {
+    if (ct->ct_services[i] != NULL)
+      RouteIndexAdd(ct, i);
+  }
+}
+/*-----------------------------------------------------------------*/
+static int
+ParseServiceOption(ServiceSig *serv, const char *word)
+{
+  /* options are single words following the port/ip fields */
+  if (strcasecmp(word, "strip") == 0) {
+    serv->ss_strip = TRUE;
+    return(SUCCESS);
+  }
+  if (strcasecmp(word, "tls") == 0) {
+    serv->ss_tls = TRUE;
+    return(SUCCESS);
+  }
+  if (strcasecmp(word, "fastopen") == 0) {
+    serv->ss_fastOpen = TRUE;
+    return(SUCCESS);
+  }
+  if (strncasecmp(word, "sockopts=", 9) == 0 && word[9] != '\0' &&
+      serv->ss_sockOpts == NULL) {
+    serv->ss_sockOpts = xstrdup(word + 9);
+    return(SUCCESS);
+  }
+  if (strcasecmp(word, "balance=leastconn") == 0) {
+    serv->ss_balance = BALANCE_LEASTCONN;
+    return(SUCCESS);
+  }
+  if (strcasecmp(word, "balance=rr") == 0) {
+    serv->ss_balance = BALANCE_RR;
+    return(SUCCESS);
+  }
+  if (strcasecmp(word, "balance=hash-url") == 0) {
+    serv->ss_balance = BALANCE_HASH_URL;
+    return(SUCCESS);
+  }
+  if (strcasecmp(word, "balance=hash-ip") == 0) {
+    serv->ss_balance = BALANCE_HASH_IP;
+    return(SUCCESS);
+  }
+  if (strcasecmp(word, "probe=tcp") == 0) {
+    serv->ss_probe = PROBE_TCP;
+    return(SUCCESS);
+  }
+  if (strncasecmp(word, "probe=/", 7) == 0 && serv->ss_probePath == NULL) {
+    serv->ss_probe = PROBE_HTTP;
+    serv->ss_probePath = xstrdup(word + 6);
+    return(SUCCESS);
+  }
+  if (strncasecmp(word, "probe-interval=", 15) == 0 && atoi(word + 15) > 0) {
+    serv->ss_probeInterval = atoi(word + 15);
+    return(SUCCESS);
+  }
+  if (strncasecmp(word, "pool=", 5) == 0 && atoi(word + 5) > 0) {
+    serv->ss_poolSize = MIN(atoi(word + 5), POOL_MAX);
+    return(SUCCESS);
+  }
+  if (strncasecmp(word, "pool-idle=", 10) == 0 && atoi(word + 10) > 0) {
+    serv->ss_poolIdle = atoi(word + 10);
+    return(SUCCESS);
+  }
+  if (strncasecmp(word, "tunnel-idle=", 12) == 0 && atoi(word + 12) > 0) {
+    serv->ss_tunnelIdle = atoi(word + 12);
+    return(SUCCESS);
+  }
+  return(FAILURE);
+}
+/*-----------------------------------------------------------------*/
+static int
+SetBackendAddr(Backend *be, struct in_addr addr, int port, const char *path)
+{
+  /* a path means a UNIX socket, and then the port is unused */
+  char name[sizeof(be->be_addr.ba_un.sun_path) + 16];
+
+  memset(&be->be_addr, 0, sizeof(be->be_addr));
+  be->be_dns = -1;
+  if (path != NULL) {
+    if (strlen(path) >= sizeof(be->be_addr.ba_un.sun_path) || path[0] != '/')
+      return(FAILURE);
+    be->be_addr.ba_un.sun_family = AF_UNIX;
+    strcpy(be->be_addr.ba_un.sun_path, path);
+    be->be_addrLen = sizeof(struct sockaddr_un);
+    snprintf(name, sizeof(name), "unix:%s", path);
+  }
+  else {
+    if (port < 1 || port > 65535 || port == DEMUX_PORT)
+      return(FAILURE);
+    be->be_addr.ba_in.sin_family = AF_INET;
+    be->be_addr.ba_in.sin_addr = addr;
+    be->be_addr.ba_in.sin_port = htons(port);
+    be->be_addrLen = sizeof(struct sockaddr_in);
+    snprintf(name, sizeof(name), "%s:%d", inet_ntoa(addr), port);
+  }
+  be->be_name = xstrdup(name);
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static int
+SetBackendHost(Backend *be, const char *host, int port)
+{
+  /* a backend given by name. its address is filled in at connect
+     time from whatever the name last resolved to */
+  struct in_addr any;
+  char name[MAX_HOST_LEN + 16];
+
+  any.s_addr = htonl(INADDR_ANY);
+  if (host[0] == '\0' || strlen(host) >= MAX_HOST_LEN ||
+      strspn(host, "abcdefghijklmnopqrstuvwxyz"
+	     "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-.") != strlen(host) ||
+      SetBackendAddr(be, any, port, NULL) != SUCCESS)
+    return(FAILURE);
+  snprintf(name, sizeof(name), "%s:%d", host, port);
+  xfree(be->be_name);
+  be->be_name = xstrdup(name);
+  be->be_dns = DnsRef(host);
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static void
+FreeBackends(Backend *be, int num)
+{
+  int i;
+
+  if (be == NULL)
+    return;
+  for (i = 0; i < num; i++) {
+    xfree(be[i].be_name);
+    if (be[i].be_dns >= 0)
+      DnsRelease(be[i].be_dns);
+  }
+  xfree(be);
+}
+/*-----------------------------------------------------------------*/
+static int
+ParseBackends(ServiceSig *serv, const char *spec, struct in_addr defAddr,
+	      const char *defHost, const char *defPath)
+{
+  /* spec is a comma separated list of [ip:]port[@weight],
+     name:port[@weight] or unix:/path[@weight]. defHost or defPath,
+     if set, is used for bare ports */
+  char *copy = xstrdup(spec);
+  char *tok, *save;
+  int num = 1;
+  const char *walk;
+
+  for (walk = spec; *walk != '\0'; walk++) {
+    if (*walk == ',')
+      num++;
+  }
+  serv->ss_backends = xcalloc(num, sizeof(Backend));
+  serv->ss_numBackends = 0;
+
+  for (tok = strtok_r(copy, ",", &save); tok != NULL; 
+       tok = strtok_r(NULL, ",", &save)) {
+    Backend *be = &serv->ss_backends[serv->ss_numBackends];
+    struct in_addr addr = defAddr;
+    const char *path = defPath;
+    char *temp;
+
+    be->be_weight = 1;
+    be->be_healthy = TRUE;
+    be->be_probeFd = -1;
+    be->be_idleFd = -1;
+    if ((temp = strchr(tok, '@')) != NULL) {
+      *temp = '\0';
+      if ((be->be_weight = atoi(temp+1)) < 1 || 
+	  be->be_weight > BACKEND_WEIGHT_MAX)
+	break;
+    }
+    if (strncmp(tok, "unix:", 5) == 0)
+      path = tok + 5;
+    else if ((temp = strchr(tok, ':')) != NULL) {
+      *temp = '\0';
+      if (inet_aton(tok, &addr) == 0) {
+	if (SetBackendHost(be, tok, atoi(temp + 1)) != SUCCESS)
+	  break;
+	serv->ss_numBackends++;
+	continue;
+      }
+      path = NULL;
+      tok = temp + 1;
+    }
+    else if (defHost != NULL) {
+      if (SetBackendHost(be, defHost, atoi(tok)) != SUCCESS)
+	break;
+      serv->ss_numBackends++;
+      continue;
+    }
+    if (SetBackendAddr(be, addr, atoi(tok), path) != SUCCESS)
+      break;
+    serv->ss_numBackends++;
+  }
+  xfree(copy);
+
+  if (serv->ss_numBackends != num) {
+    FreeBackends(serv->ss_backends, serv->ss_numBackends);
+    serv->ss_backends = NULL;
+    serv->ss_numBackends = 0;
+    return(FAILURE);
+  }
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static void
+BackendRefresh(Backend *be)
+{
+  /* a named backend goes to whatever its name last resolved to */
+  if (be->be_dns >= 0)
+    DnsLookup(be->be_dns, &be->be_addr.ba_in.sin_addr);
+}
+/*-----------------------------------------------------------------*/
+static int
+BackendUsable(Backend *be)
+{
+  /* an open breaker lets one trial through once it has cooled down */
+  if (!be->be_healthy || 
+      (be->be_dns >= 0 && DnsLookup(be->be_dns, NULL) != SUCCESS))
+    return(FALSE);
+  switch (be->be_state) {
+  case BREAKER_OPEN:
+    return(now - be->be_openedAt >= BREAKER_COOLDOWN);
+  case BREAKER_HALF_OPEN:
+    return(!be->be_trying);
+  }
+  return(TRUE);
+}
+/*-----------------------------------------------------------------*/
+static void
+BackendFailed(Backend *be)
+{
+  be->be_trying = FALSE;
+  if (be->be_state == BREAKER_OPEN ||
+      (be->be_state == BREAKER_CLOSED && 
+       ++be->be_failures < BREAKER_FAILURES))
+    return;
+  /* a failed trial opens it again right away */
+  be->be_state = BREAKER_OPEN;
+  be->be_openedAt = now;
+  be->be_numOpened++;
+  fprintf(stderr, "backend %s down\n", be->be_name);
+}
+/*-----------------------------------------------------------------*/
+static void
+BackendWorked(Backend *be)
+{
+  be->be_failures = 0;
+  be->be_trying = FALSE;
+  if (be->be_state == BREAKER_CLOSED)
+    return;
+  be->be_state = BREAKER_CLOSED;
+  be->be_numClosed++;
+  fprintf(stderr, "backend %s up\n", be->be_name);
+}
+/*-----------------------------------------------------------------*/
+static unsigned int
+MixHash(unsigned int hash)
+{
+  /* HashString leaves similar strings close together, which would
+     bunch up the ring, so spread the bits out */
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+  return(hash);
+}
+/*-----------------------------------------------------------------*/
+static int
+RingPointCmp(const void *a, const void *b)
+{
+  unsigned int ha = ((const RingPoint *) a)->rp_hash;
+  unsigned int hb = ((const RingPoint *) b)->rp_hash;
+
+  return((ha > hb) - (ha < hb));
+}
+/*-----------------------------------------------------------------*/
+static void
+BuildRing(ServiceSig *ss)
+{
+  /* points come from the backend's address, not its position, so
+     the other backends keep theirs when the list changes. a ring too
+     big to count in an int falls back to least connections */
+  size_t num = 0;
+  int i, v;
+
+  if (ss->ss_balance != BALANCE_HASH_URL && 
+      ss->ss_balance != BALANCE_HASH_IP)
+    return;
+  for (i = 0; i < ss->ss_numBackends; i++)
+    num += (size_t) ss->ss_backends[i].be_weight * RING_VNODES;
+  if (num > INT_MAX / sizeof(RingPoint)) {
+    fprintf(stderr, "too many ring points for %d backends, "
+	    "using leastconn\n", ss->ss_numBackends);
+    ss->ss_balance = BALANCE_LEASTCONN;
+    return;
+  }
+  ss->ss_ring = xcalloc(num, sizeof(RingPoint));
+  for (i = 0; i < ss->ss_numBackends; i++) {
+    Backend *be = &ss->ss_backends[i];
+    for (v = 0; v < be->be_weight * RING_VNODES; v++) {
+      char name[160];
+      snprintf(name, sizeof(name), "%s-%d", be->be_name, v);
+      ss->ss_ring[ss->ss_ringSize].rp_hash = 
+	MixHash(HashString(name, 0, FALSE, FALSE));
+      ss->ss_ring[ss->ss_ringSize].rp_backend = i;
+      ss->ss_ringSize++;
+    }
+  }
+  qsort(ss->ss_ring, ss->ss_ringSize, sizeof(RingPoint), RingPointCmp);
+}
+/*-----------------------------------------------------------------*/
+static int
+RingLookup(ServiceSig *ss, unsigned int hash)
+{
+  /* the first point at or after the hash, wrapping around, whose
+     backend can take it. returns -1 if none can */
+  int lo = 0, hi = ss->ss_ringSize;
+  int i;
+
+  hash = MixHash(hash);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ss->ss_ring[mid].rp_hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (i = 0; i < ss->ss_ringSize; i++) {
+    RingPoint *rp = &ss->ss_ring[(lo + i) % ss->ss_ringSize];
+    if (BackendUsable(&ss->ss_backends[rp->rp_backend]))
+      return(rp->rp_backend);
+  }
+  return(-1);
+}
+/*-----------------------------------------------------------------*/
+static void
+SnapMapRelease(SnapMap *sm)
+{
+  if (sm == NULL || --sm->sm_refs > 0)
+    return;
+  munmap(sm->sm_addr, sm->sm_len);
+  xfree(sm);
+}
+/*-----------------------------------------------------------------*/
+static void
+ServiceRelease(ServiceSig *ss)
+{
+  /* frees the service once no table or connection uses it */
+  if (ss == NULL || --ss->ss_refs > 0)
+    return;
+
+  if (ss->ss_map == NULL) {
+    xfree(ss->ss_line);
+    xfree(ss->ss_host);
+    xfree(ss->ss_slice);
+    if (ss->ss_prefix != NULL)
+      xfree(ss->ss_prefix);
+    if (ss->ss_probePath != NULL)
+      xfree(ss->ss_probePath);
+    if (ss->ss_sockOpts != NULL)
+      xfree(ss->ss_sockOpts);
+  }
+  else
+    SnapMapRelease(ss->ss_map);
+  FreeBackends(ss->ss_backends, ss->ss_numBackends);
+  if (ss->ss_ring != NULL)
+    xfree(ss->ss_ring);
+  SliceRelease(ss->ss_slicePos);
+  xfree(ss);
+}
+/*-----------------------------------------------------------------*/
+static void
+ConfTableAdd(ConfTable *ct, ServiceSig *ss)
+{
+  /* the table takes over the caller's reference */
+  if (ct->ct_numServices >= ct->ct_numAlloc) {
+    ct->ct_numAlloc = MAX(ct->ct_numAlloc * 2, 8);
+    ct->ct_services = xrealloc(ct->ct_services, 
+			       ct->ct_numAlloc * sizeof(ServiceSig *));
+    if (ct->ct_services == NULL)
+      NiceExit(-1, "out of memory");
+  }
+  ct->ct_services[ct->ct_numServices++] = ss;
+}
+/*-----------------------------------------------------------------*/
+static void
+ConfTableHashLine(ConfTable *ct, ServiceSig *ss)
+{
+  /* open hash of the services by conf line, at most half full, so
+     the next reload can find unchanged lines in one probe or so */
+  int slot;
+
+  if ((ct->ct_linesUsed + 1) * 2 > ct->ct_linesSize) {
+    ServiceSig **old = ct->ct_lines;
+    int oldSize = ct->ct_linesSize;
+    int i;
+
+    ct->ct_linesSize = MAX(16, oldSize * 2);
+    ct->ct_lines = xcalloc(ct->ct_linesSize, sizeof(ServiceSig *));
+    ct->ct_linesUsed = 0;
+    for (i = 0; i < oldSize; i++) {
+      if (old[i] != NULL)
+	ConfTableHashLine(ct, old[i]);
+    }
+    if (old != NULL)
+      xfree(old);
+  }
+  slot = ss->ss_lineHash & (ct->ct_linesSize - 1);
+  while (ct->ct_lines[slot] != NULL)
+    slot = (slot + 1) & (ct->ct_linesSize - 1);
+  ct->ct_lines[slot] = ss;
+  ct->ct_linesUsed++;
+}
+/*-----------------------------------------------------------------*/
+static void
+ConfTableUnhashLine(ConfTable *ct, ServiceSig *ss)
+{
+  int mask = ct->ct_linesSize - 1;
+  int slot;
+
+  if (ct->ct_lines == NULL)
+    return;
+  for (slot = ss->ss_lineHash & mask; ct->ct_lines[slot] != ss;
+       slot = (slot + 1) & mask) {
+    if (ct->ct_lines[slot] == NULL)
+      return;
+  }
+  ct->ct_lines[slot] = NULL;
+  ct->ct_linesUsed--;
+
+  /* rehash the rest of the run, so nothing after the gap is lost */
+  for (slot = (slot + 1) & mask; ct->ct_lines[slot] != NULL;
+       slot = (slot + 1) & mask) {
+    ServiceSig *move = ct->ct_lines[slot];
+    ct->ct_lines[slot] = NULL;
+    ct->ct_linesUsed--;
+    ConfTableHashLine(ct, move);
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+ConfTableHashLines(ConfTable *ct)
+{
+  int i;
+
+  for (i = 0; i < ct->ct_numServices; i++) {
+    if (ct->ct_services[i] != NULL)
+      ConfTableHashLine(ct, ct->ct_services[i]);
+  }
+}
+/*-----------------------------------------------------------------*/
+static ServiceSig *
+ConfTableFindLine(ConfTable *ct, const char *line, unsigned int hash)
+{
+  int slot;
+
+  if (ct == NULL || ct->ct_lines == NULL)
+    return(NULL);
+  for (slot = hash & (ct->ct_linesSize - 1); ct->ct_lines[slot] != NULL;
+       slot = (slot + 1) & (ct->ct_linesSize - 1)) {
+    ServiceSig *ss = ct->ct_lines[slot];
+    if (ss->ss_lineHash == hash && strcmp(ss->ss_line, line) == 0)
+      return(ss);
+  }
+  return(NULL);
+}
+/*-----------------------------------------------------------------*/
+static void
+ParseSockProfile(ConfTable *ct, char *line)
+{
+  /* a line like "%sockopts <name> <option>...". the table keeps the
+     line */
+  SockProfile sp;
+  char *word;
+  int i, whichWord;
+
+  memset(&sp, 0, sizeof(sp));
+  if ((sp.sp_name = GetWord(line, 1)) == NULL) {
+    fprintf(stderr, "bad line: %s\n", line);
+    xfree(line);
+    return;
+  }
+  for (i = 0; i < ct->ct_numProfiles; i++) {
+    if (strcmp(ct->ct_profiles[i].sp_name, sp.sp_name) == 0) {
+      fprintf(stderr, "duplicate sockopts ignored: %s\n", line);
+      xfree(sp.sp_name);
+      xfree(line);
+      return;
+    }
+  }
+
+  for (whichWord = 2; (word = GetWord(line, whichWord)) != NULL;
+       whichWord++) {
+    if (strcasecmp(word, "nodelay") == 0)
+      sp.sp_noDelay = TRUE;
+    else if (strcasecmp(word, "cork") == 0)
+      sp.sp_cork = TRUE;
+    else if (strncasecmp(word, "sndbuf=", 7) == 0 && atoi(word + 7) > 0)
+      sp.sp_sndBuf = atoi(word + 7);
+    else if (strncasecmp(word, "rcvbuf=", 7) == 0 && atoi(word + 7) > 0)
+      sp.sp_rcvBuf = atoi(word + 7);
+    else if (strncasecmp(word, "notsent-lowat=", 14) == 0 && 
+	     atoi(word + 14) > 0)
+      sp.sp_notSentLowat = atoi(word + 14);
+    else if (strncasecmp(word, "cc=", 3) == 0 && word[3] != '\0' &&
+	     strlen(word + 3) < sizeof(sp.sp_cc))
+      strcpy(sp.sp_cc, word + 3);
+    else
+      fprintf(stderr, "bad option %s: %s\n", word, line);
+    xfree(word);
+  }
+
+  sp.sp_line = line;
+  ct->ct_profiles = xrealloc(ct->ct_profiles, 
+			     (ct->ct_numProfiles + 1) * sizeof(SockProfile));
+  if (ct->ct_profiles == NULL)
+    NiceExit(-1, "out of memory");
+  ct->ct_profiles[ct->ct_numProfiles++] = sp;
+}
+/*-----------------------------------------------------------------*/
+static void
+FindSockProfile(ConfTable *ct, ServiceSig *ss)
+{
+  /* profiles are looked up by name whenever a table is built, so a
+     changed sockopts line applies to services that didn't change */
+  int i;
+
+  if (ss == NULL)
+    return;
+  ss->ss_profile = -1;
+  if (ss->ss_sockOpts == NULL)
+    return;
+  for (i = 0; i < ct->ct_numProfiles; i++) {
+    if (strcmp(ct->ct_profiles[i].sp_name, ss->ss_sockOpts) == 0) {
+      ss->ss_profile = i;
+      return;
+    }
+  }
+  fprintf(stderr, "unknown sockopts %s: %s\n", ss->ss_sockOpts, ss->ss_line);
+}
+/*-----------------------------------------------------------------*/
+static void
+ApplySockProfile(int fd, ServiceSig *ss)
+{
+  /* errors are ignored - a UNIX socket has no TCP options, and a
+     congestion control the kernel lacks leaves the default */
+  SockProfile *sp;
+  int one = 1;
+
+  if (ss->ss_profile < 0 || ss->ss_profile >= curConf->ct_numProfiles)
+    return;
+  sp = &curConf->ct_profiles[ss->ss_profile];
+  if (strcmp(sp->sp_name, ss->ss_sockOpts) != 0)
+    return;			/* a removed service, from an older table */
+  if (sp->sp_noDelay)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (sp->sp_cork)
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+  if (sp->sp_sndBuf > 0)
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, 
+	       &sp->sp_sndBuf, sizeof(sp->sp_sndBuf));
+  if (sp->sp_rcvBuf > 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, 
+	       &sp->sp_rcvBuf, sizeof(sp->sp_rcvBuf));
+  if (sp->sp_notSentLowat > 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, 
+	       &sp->sp_notSentLowat, sizeof(sp->sp_notSentLowat));
+  if (sp->sp_cc[0] != '\0')
+    setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, 
+	       sp->sp_cc, strlen(sp->sp_cc));
+}
+/*-----------------------------------------------------------------*/
+static int
+ParseRate(const char *val)
+{
+  /* bytes per second, with an optional k or m. 0 if it's bad */
+  char *end;
+  long rate = strtol(val, &end, 10);
+
+  if (*end == 'k' || *end == 'K') {
+    rate *= 1024;
+    end++;
+  }
+  else if (*end == 'm' || *end == 'M') {
+    rate *= 1024 * 1024;
+    end++;
+  }
+  if (*end != '\0' || rate < 1 || rate > 1024 * 1024 * 1024)
+    return(0);
+  return(rate);
+}
+/*-----------------------------------------------------------------*/
+static void
+ParseSliceConf(ConfTable *ct, char *line)
+{
+  /* a line like "%slice <name> [weight=N] [min=N] [max=N]". the
+     table keeps the line */
+  SliceConf sc;
+  char *word;
+  int i, whichWord;
+
+  memset(&sc, 0, sizeof(sc));
+  sc.sc_weight = 1;
+  sc.sc_queueWait = QUEUE_WAIT;
+  if ((sc.sc_name = GetWord(line, 1)) == NULL) {
+    fprintf(stderr, "bad line: %s\n", line);
+    xfree(line);
+    return;
+  }
+  for (i = 0; i < ct->ct_numSliceConfs; i++) {
+    if (strcasecmp(ct->ct_sliceConfs[i].sc_name, sc.sc_name) == 0) {
+      fprintf(stderr, "duplicate slice ignored: %s\n", line);
+      xfree(sc.sc_name);
+      xfree(line);
+      return;
+    }
+  }
+
+  for (whichWord = 2; (word = GetWord(line, whichWord)) != NULL;
+       whichWord++) {
+    if (strncasecmp(word, "weight=", 7) == 0 && atoi(word + 7) > 0)
+      sc.sc_weight = atoi(word + 7);
+    else if (strncasecmp(word, "min=", 4) == 0 && atoi(word + 4) > 0)
+      sc.sc_minConns = atoi(word + 4);
+    else if (strncasecmp(word, "max=", 4) == 0 && atoi(word + 4) > 0)
+      sc.sc_maxConns = atoi(word + 4);
+    else if (strncasecmp(word, "rate=", 5) == 0 && 
+	     (sc.sc_rate = ParseRate(word + 5)) > 0)
+      ;
+    else if (strncasecmp(word, "conn-rate=", 10) == 0 && 
+	     (sc.sc_connRate = ParseRate(word + 10)) > 0)
+      ;
+    else if (strncasecmp(word, "queue=", 6) == 0 && atoi(word + 6) > 0)
+      sc.sc_queueMax = atoi(word + 6);
+    else if (strncasecmp(word, "queue-wait=", 11) == 0 && 
+	     atoi(word + 11) > 0)
+      sc.sc_queueWait = atoi(word + 11);
+    else if (strcasecmp(word, "low") == 0)
+      sc.sc_low = TRUE;
+    else
+      fprintf(stderr, "bad option %s: %s\n", word, line);
+    xfree(word);
+  }
+
+  sc.sc_line = line;
+  ct->ct_sliceConfs = xrealloc(ct->ct_sliceConfs, 
+			       (ct->ct_numSliceConfs + 1) * sizeof(SliceConf));
+  if (ct->ct_sliceConfs == NULL)
+    NiceExit(-1, "out of memory");
+  ct->ct_sliceConfs[ct->ct_numSliceConfs++] = sc;
+}
+/*-----------------------------------------------------------------*/
+static void
+ParseClientConf(ConfTable *ct, char *line)
+{
+  /* a line like "%client [conns=N] [rate=N]". the table keeps the
+     line */
+  char *word;
+  int whichWord;
+
+  if (ct->ct_clientLine != NULL) {
+    fprintf(stderr, "duplicate client ignored: %s\n", line);
+    xfree(line);
+    return;
+  }
+  for (whichWord = 1; (word = GetWord(line, whichWord)) != NULL;
+       whichWord++) {
+    if (strncasecmp(word, "conns=", 6) == 0 && atoi(word + 6) > 0)
+      ct->ct_clientConns = atoi(word + 6);
+    else if (strncasecmp(word, "rate=", 5) == 0 && atoi(word + 5) > 0)
+      ct->ct_clientRate = atoi(word + 5);
+    else
+      fprintf(stderr, "bad option %s: %s\n", word, line);
+    xfree(word);
+  }
+  ct->ct_clientLine = line;
+}
+/*-----------------------------------------------------------------*/
+static void
+ParseShedConf(ConfTable *ct, char *line)
+{
+  /* a line like "%shed [reject=ms] [defer=ms] [refuse=ms] [ready=N]".
+     a step that isn't given is never taken. the table keeps the line */
+  static const char *names[SHED_LEVELS] = {"reject=", "defer=", "refuse="};
+  char *word;
+  int i, whichWord;
+
+  if (ct->ct_shedLine != NULL) {
+    fprintf(stderr, "duplicate shed ignored: %s\n", line);
+    xfree(line);
+    return;
+  }
+  for (whichWord = 1; (word = GetWord(line, whichWord)) != NULL;
+       whichWord++) {
+    for (i = 0; i < SHED_LEVELS; i++) {
+      int len = strlen(names[i]);
+      if (strncasecmp(word, names[i], len) == 0 && atoi(word + len) > 0) {
+	ct->ct_shedLag[i] = atoi(word + len);
+	break;
+      }
+    }
+    if (i == SHED_LEVELS) {
+      if (strncasecmp(word, "ready=", 6) == 0 && atoi(word + 6) > 0)
+	ct->ct_shedReady = atoi(word + 6);
+      else
+	fprintf(stderr, "bad option %s: %s\n", word, line);
+    }
+    xfree(word);
+  }
+  ct->ct_shedLine = line;
+}
+/*-----------------------------------------------------------------*/
+static int
+ParseOptionLine(ConfTable *ct, char *line)
+{
+  /* takes the lines that aren't services, which start with "%" so
+     no host can look like one. returns TRUE if the line was one, and
+     the table has it now */
+  char *word = GetWord(line, 0);
+
+  if (word == NULL)
+    return(FALSE);
+  if (word[0] != '%') {
+    xfree(word);
+    return(FALSE);
+  }
+  if (strcasecmp(word, "%sockopts") == 0)
+    ParseSockProfile(ct, line);
+  else if (strcasecmp(word, "%slice") == 0)
+    ParseSliceConf(ct, line);
+  else if (strcasecmp(word, "%client") == 0)
+    ParseClientConf(ct, line);
+  else if (strcasecmp(word, "%shed") == 0)
+    ParseShedConf(ct, line);
+  else {
+    fprintf(stderr, "unknown option line: %s\n", line);
+    xfree(line);
+  }
+  xfree(word);
+  return(TRUE);
+}
+/*-----------------------------------------------------------------*/
+static void
+ApplySliceConf(ConfTable *ct, int pos)
+{
+  /* a slice without a line gets the defaults back, which also drops
+     any limit set through the control socket */
+  SliceInfo *si = &slices[pos];
+  int oldRate = si->si_rate;
+  int i;
+
+  si->si_weight = 1;
+  si->si_minConns = 0;
+  si->si_maxConns = 0;
+  si->si_maxTunnels = 0;
+  si->si_rate = 0;
+  si->si_connRate = 0;
+  si->si_queueMax = 0;
+  si->si_queueWait = QUEUE_WAIT;
+  si->si_low = FALSE;
+  for (i = 0; i < ct->ct_numSliceConfs; i++) {
+    SliceConf *sc = &ct->ct_sliceConfs[i];
+    if (strcasecmp(sc->sc_name, si->si_sliceName) == 0) {
+      si->si_weight = sc->sc_weight;
+      si->si_minConns = sc->sc_minConns;
+      si->si_maxConns = sc->sc_maxConns;
+      si->si_rate = sc->sc_rate;
+      si->si_connRate = sc->sc_connRate;
+      si->si_queueMax = sc->sc_queueMax;
+      si->si_queueWait = sc->sc_queueWait;
+      si->si_low = sc->sc_low;
+      break;
+    }
+  }
+  if (si->si_rate > 0) {
+    si->si_tokens = (oldRate == 0) ? SHAPE_DEPTH(si->si_rate) :
+      MIN(si->si_tokens, SHAPE_DEPTH(si->si_rate));
+    anyShaping = TRUE;
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+ConfTableFree(ConfTable *ct)
+{
+  int i;
+
+  if (ct == NULL)
+    return;
+  for (i = 0; i < ct->ct_numServices; i++)
+    ServiceRelease(ct->ct_services[i]);
+  if (ct->ct_map == NULL)
+    RadixFree(&ct->ct_index);
+  else
+    SnapMapRelease(ct->ct_map);
+  if (ct->ct_services != NULL)
+    xfree(ct->ct_services);
+  if (ct->ct_lines != NULL)
+    xfree(ct->ct_lines);
+  for (i = 0; i < ct->ct_numProfiles; i++) {
+    xfree(ct->ct_profiles[i].sp_line);
+    xfree(ct->ct_profiles[i].sp_name);
+  }
+  if (ct->ct_profiles != NULL)
+    xfree(ct->ct_profiles);
+  for (i = 0; i < ct->ct_numSliceConfs; i++) {
+    xfree(ct->ct_sliceConfs[i].sc_line);
+    xfree(ct->ct_sliceConfs[i].sc_name);
+  }
+  if (ct->ct_sliceConfs != NULL)
+    xfree(ct->ct_sliceConfs);
+  if (ct->ct_clientLine != NULL)
+    xfree(ct->ct_clientLine);
+  if (ct->ct_shedLine != NULL)
+    xfree(ct->ct_shedLine);
+  xfree(ct);
+}
+/*-----------------------------------------------------------------*/
+static void
+SwapConfTable(ConfTable *ct, int numKept)
+{
+  /* the new table is complete before anyone can see it. services
+     the new table didn't keep are freed along with the old table,
+     unless a connection still holds them */
+  ConfTable *old = curConf;
+  int numRemoved = 0;
+  int i;
+
+  ConfTableHashLines(ct);
+  for (i = 0; i < ct->ct_numServices; i++)
+    FindSockProfile(ct, ct->ct_services[i]);
+  anyShaping = FALSE;
+  for (i = 0; i < numSlices; i++) {
+    if (slices[i].si_sliceName != NULL)
+      ApplySliceConf(ct, i);
+  }
+  ComputeShares();
+  if (old != NULL) {
+    for (i = 0; i < old->ct_numServices; i++) {
+      if (old->ct_services[i] != NULL &&
+	  old->ct_services[i]->ss_gen != confGen)
+	numRemoved++;
+    }
+  }
+  curConf = ct;
+  ConfTableFree(old);
+  fprintf(stderr, "conf loaded: %d services, %d added, %d removed\n",
+	  ct->ct_numServices, ct->ct_numServices - numKept, numRemoved);
+}
+/*-----------------------------------------------------------------*/
+static void
+ConfTableOwnIndex(ConfTable *ct)
+{
+  /* an index that points into a snapshot is read-only, so copy it
+     before changing it */
+  RadixTree *rt = &ct->ct_index;
+  RadixNode *nodes;
+  char *labels;
+
+  if (ct->ct_map == NULL)
+    return;
+  nodes = xmalloc(MAX(rt->rt_numNodes, 1) * sizeof(RadixNode));
+  labels = xmalloc(MAX(rt->rt_labelsUsed, 1));
+  if (nodes == NULL || labels == NULL)
+    NiceExit(-1, "out of memory");
+  memcpy(nodes, rt->rt_nodes, rt->rt_numNodes * sizeof(RadixNode));
+  memcpy(labels, rt->rt_labels, rt->rt_labelsUsed);
+  rt->rt_nodes = nodes;
+  rt->rt_numNodesAlloc = MAX(rt->rt_numNodes, 1);
+  rt->rt_labels = labels;
+  rt->rt_labelsAlloc = MAX(rt->rt_labelsUsed, 1);
+  SnapMapRelease(ct->ct_map);
+  ct->ct_map = NULL;
+}
+/*-----------------------------------------------------------------*/
+static void
+ConfTableCompact(ConfTable *ct)
+{
+  /* squeezes out the holes and rebuilds the index, which also
+     brings back any duplicate rule whose winner was removed */
+  int i, used = 0;
+
+  for (i = 0; i < ct->ct_numServices; i++) {
+    if (ct->ct_services[i] != NULL)
+      ct->ct_services[used++] = ct->ct_services[i];
+  }
+  ct->ct_numServices = used;
+  ct->ct_numHoles = 0;
+  if (ct->ct_map == NULL)
+    RadixFree(&ct->ct_index);
+  else {
+    SnapMapRelease(ct->ct_map);
+    ct->ct_map = NULL;
+  }
+  BuildRouteIndex(ct);
+}
+/*-----------------------------------------------------------------*/
+static int
+SnapAddString(char **strs, int *used, int *alloc, const char *str)
+{
+  int off, len;
+
+  if (str == NULL)
+    return(-1);
+  len = strlen(str) + 1;
+  if (*used + len > *alloc) {
+    *alloc = MAX(*used + len, MAX(1024, *alloc * 2));
+    if ((*strs = xrealloc(*strs, *alloc)) == NULL)
+      NiceExit(-1, "out of memory");
+  }
+  off = *used;
+  memcpy(*strs + off, str, len);
+  *used += len;
+  return(off);
+}
+/*-----------------------------------------------------------------*/
+static int
+WriteSnapshot(const char *path, struct stat *confStat)
+{
+  /* dumps the current services, slice names and route index. the
+     file is written aside and renamed, so a running codemux never
+     sees it half-written */
+  char tmpPath[1024];
+  SnapHeader *sh;
+  SnapService *sv;
+  SnapBackend *sb;
+  int numBackends = 0;
+  int *sliceNames;
+  int *snapSlicePos;
+  int numSnapSlices = 0;
+  int *optLines;
+  int numOptLines = 0;
+  char *strs = NULL;
+  int strsUsed = 0, strsAlloc = 0;
+  ConfTable *ct = curConf;
+  char *buf;
+  int size, off, fd, i, j;
+
+  /* the snapshot's slice table only has the slices in use, in the
+     order the services first mention them */
+  sv = xcalloc(MAX(ct->ct_numServices, 1), sizeof(SnapService));
+  for (i = 0; i < ct->ct_numServices; i++)
+    numBackends += ct->ct_services[i]->ss_numBackends;
+  sb = xcalloc(MAX(numBackends, 1), sizeof(SnapBackend));
+  numBackends = 0;
+  sliceNames = xcalloc(MAX(numSlices, 1), sizeof(int));
+  snapSlicePos = xcalloc(MAX(numSlices, 1), sizeof(int));
+  for (i = 0; i < numSlices; i++)
+    snapSlicePos[i] = -1;
+  for (i = 0; i < ct->ct_numServices; i++) {
+    ServiceSig *ss = ct->ct_services[i];
+    if (snapSlicePos[ss->ss_slicePos] < 0) {
+      snapSlicePos[ss->ss_slicePos] = numSnapSlices;
+      sliceNames[numSnapSlices++] = 
+	SnapAddString(&strs, &strsUsed, &strsAlloc, 
+		      slices[ss->ss_slicePos].si_sliceName);
+    }
+    sv[i].sv_line = SnapAddString(&strs, &strsUsed, &strsAlloc, ss->ss_line);
+    sv[i].sv_host = SnapAddString(&strs, &strsUsed, &strsAlloc, ss->ss_host);
+    sv[i].sv_slice = SnapAddString(&strs, &strsUsed, &strsAlloc, 
+				   ss->ss_slice);
+    sv[i].sv_prefix = SnapAddString(&strs, &strsUsed, &strsAlloc, 
+				    ss->ss_prefix);
+    sv[i].sv_backends = numBackends;
+    sv[i].sv_numBackends = ss->ss_numBackends;
+    for (j = 0; j < ss->ss_numBackends; j++, numBackends++) {
+      Backend *be = &ss->ss_backends[j];
+      sb[numBackends].sb_host = -1;
+      if (be->be_addr.ba_sa.sa_family == AF_UNIX) {
+	sb[numBackends].sb_path = SnapAddString(&strs, &strsUsed, &strsAlloc,
+						be->be_addr.ba_un.sun_path);
+      }
+      else {
+	sb[numBackends].sb_addr = be->be_addr.ba_in.sin_addr.s_addr;
+	sb[numBackends].sb_port = ntohs(be->be_addr.ba_in.sin_port);
+	sb[numBackends].sb_path = -1;
+	if (be->be_dns >= 0)
+	  sb[numBackends].sb_host = 
+	    SnapAddString(&strs, &strsUsed, &strsAlloc, DnsName(be->be_dns));
+      }
+      sb[numBackends].sb_weight = be->be_weight;
+    }
+    sv[i].sv_balance = ss->ss_balance;
+    sv[i].sv_strip = ss->ss_strip;
+    sv[i].sv_probe = ss->ss_probe;
+    sv[i].sv_probePath = SnapAddString(&strs, &strsUsed, &strsAlloc, 
+				       ss->ss_probePath);
+    sv[i].sv_probeInterval = ss->ss_probeInterval;
+    sv[i].sv_poolSize = ss->ss_poolSize;
+    sv[i].sv_poolIdle = ss->ss_poolIdle;
+    sv[i].sv_tunnelIdle = ss->ss_tunnelIdle;
+    sv[i].sv_tls = ss->ss_tls;
+    sv[i].sv_fastOpen = ss->ss_fastOpen;
+    sv[i].sv_sockOpts = SnapAddString(&strs, &strsUsed, &strsAlloc,
+				      ss->ss_sockOpts);
+    sv[i].sv_slicePos = snapSlicePos[ss->ss_slicePos];
+  }
+  xfree(snapSlicePos);
+  optLines = xcalloc(ct->ct_numProfiles + ct->ct_numSliceConfs + 2, 
+		     sizeof(int));
+  for (i = 0; i < ct->ct_numProfiles; i++)
+    optLines[numOptLines++] = SnapAddString(&strs, &strsUsed, &strsAlloc, 
+					    ct->ct_profiles[i].sp_line);
+  for (i = 0; i < ct->ct_numSliceConfs; i++)
+    optLines[numOptLines++] = SnapAddString(&strs, &strsUsed, &strsAlloc, 
+					    ct->ct_sliceConfs[i].sc_line);
+  if (ct->ct_clientLine != NULL)
+    optLines[numOptLines++] = SnapAddString(&strs, &strsUsed, &strsAlloc, 
+					    ct->ct_clientLine);
+  if (ct->ct_shedLine != NULL)
+    optLines[numOptLines++] = SnapAddString(&strs, &strsUsed, &strsAlloc, 
+					    ct->ct_shedLine);
+
+  /* lay out the sections */
+  size = SNAP_ALIGN(sizeof(SnapHeader));
+  buf = NULL;
+  sh = xcalloc(1, sizeof(SnapHeader));
+  sh->sh_magic = SNAP_MAGIC;
+  sh->sh_version = SNAP_VERSION;
+  sh->sh_confMtime = confStat->st_mtim.tv_sec;
+  sh->sh_confMtimeNsec = confStat->st_mtim.tv_nsec;
+  sh->sh_confSize = confStat->st_size;
+  sh->sh_netflowName = SnapAddString(&strs, &strsUsed, &strsAlloc, 
+				     domainNamePLCNetflow);
+  sh->sh_numServices = ct->ct_numServices;
+  sh->sh_servicesOff = size;
+  size += SNAP_ALIGN(ct->ct_numServices * sizeof(SnapService));
+  sh->sh_numBackends = numBackends;
+  sh->sh_backendsOff = size;
+  size += SNAP_ALIGN(numBackends * sizeof(SnapBackend));
+  sh->sh_numSlices = numSnapSlices;
+  sh->sh_slicesOff = size;
+  size += SNAP_ALIGN(numSnapSlices * sizeof(int));
+  sh->sh_numOptLines = numOptLines;
+  sh->sh_optLinesOff = size;
+  size += SNAP_ALIGN(numOptLines * sizeof(int));
+  sh->sh_numNodes = ct->ct_index.rt_numNodes;
+  sh->sh_nodesOff = size;
+  size += SNAP_ALIGN(ct->ct_index.rt_numNodes * sizeof(RadixNode));
+  sh->sh_labelsLen = ct->ct_index.rt_labelsUsed;
+  sh->sh_labelsOff = size;
+  size += SNAP_ALIGN(ct->ct_index.rt_labelsUsed);
+  sh->sh_hostRoot = ct->ct_hostRoot;
+  sh->sh_stringsLen = strsUsed;
+  sh->sh_stringsOff = size;
+  size += SNAP_ALIGN(strsUsed);
+  sh->sh_size = size;
+
+  buf = xcalloc(1, size);
+  memcpy(&buf[sh->sh_servicesOff], sv, ct->ct_numServices * sizeof(SnapService));
+  memcpy(&buf[sh->sh_backendsOff], sb, numBackends * sizeof(SnapBackend));
+  memcpy(&buf[sh->sh_slicesOff], sliceNames, numSnapSlices * sizeof(int));
+  memcpy(&buf[sh->sh_optLinesOff], optLines, numOptLines * sizeof(int));
+  memcpy(&buf[sh->sh_nodesOff], ct->ct_index.rt_nodes, 
+	 ct->ct_index.rt_numNodes * sizeof(RadixNode));
+  memcpy(&buf[sh->sh_labelsOff], ct->ct_index.rt_labels, 
+	 ct->ct_index.rt_labelsUsed);
+  memcpy(&buf[sh->sh_stringsOff], strs, strsUsed);
+  off = SNAP_ALIGN(sizeof(SnapHeader));
+  sh->sh_checksum = HashBuffer(&buf[off], size - off, 0);
+  memcpy(buf, sh, sizeof(SnapHeader));
+
+  xfree(sv);
+  xfree(sb);
+  xfree(sliceNames);
+  xfree(optLines);
+  xfree(sh);
+  if (strs != NULL)
+    xfree(strs);
+
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  if ((fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    xfree(buf);
+    return(FAILURE);
+  }
+  if (write(fd, buf, size) != size || fsync(fd) != 0) {
+    close(fd);
+    unlink(tmpPath);
+    xfree(buf);
+    return(FAILURE);
+  }
+  close(fd);
+  xfree(buf);
+  if (rename(tmpPath, path) != 0) {
+    unlink(tmpPath);
+    return(FAILURE);
+  }
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static int
+SnapSectionOK(SnapHeader *sh, int off, int num, int size)
+{
+  return(off >= (int) sizeof(SnapHeader) && num >= 0 && 
+	 (long long) off + (long long) num * size <= sh->sh_size);
+}
+/*-----------------------------------------------------------------*/
+static int
+SnapStringOK(SnapHeader *sh, int str, int allowNull)
+{
+  if (str == -1)
+    return(allowNull);
+  return(str >= 0 && str < sh->sh_stringsLen);
+}
+/*-----------------------------------------------------------------*/
+static int
+CheckSnapNode(SnapHeader *sh, RadixNode *rn, int node, int isHost, 
+	      char *visited)
+{
+  /* host trie values are path trie roots, path trie values are
+     services. any node reached twice means a loop */
+  int child;
+
+  if (visited[node])
+    return(FAILURE);
+  visited[node] = TRUE;
+
+  if (rn[node].rn_val != RADIX_NONE) {
+    if (isHost) {
+      if (rn[node].rn_val < 0 || rn[node].rn_val >= sh->sh_numNodes ||
+	  CheckSnapNode(sh, rn, rn[node].rn_val, FALSE, visited) != SUCCESS)
+	return(FAILURE);
+    }
+    else if (rn[node].rn_val < 1 || rn[node].rn_val >= sh->sh_numServices)
+      return(FAILURE);
+  }
+  for (child = rn[node].rn_child; child != RADIX_NONE; 
+       child = rn[child].rn_sibling) {
+    if (rn[child].rn_labelLen < 1 ||
+	CheckSnapNode(sh, rn, child, isHost, visited) != SUCCESS)
+      return(FAILURE);
+  }
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static int
+CheckSnapshot(char *map, size_t mapLen, struct stat *confStat)
+{
+  /* the snapshot must match this conf file and be intact. every
+     offset is checked here, so the loader and the route lookups
+     can use the mapping without further checks */
+  SnapHeader *sh = (SnapHeader *) map;
+  SnapService *sv;
+  SnapBackend *sb;
+  RadixNode *rn;
+  int *sliceNames;
+  int *optLines;
+  char *visited;
+  int off = SNAP_ALIGN(sizeof(SnapHeader));
+  int i;
+
+  if (mapLen < off || sh->sh_magic != SNAP_MAGIC || 
+      sh->sh_version != SNAP_VERSION || sh->sh_size != mapLen)
+    return(FAILURE);
+  if (sh->sh_confMtime != confStat->st_mtim.tv_sec ||
+      sh->sh_confMtimeNsec != confStat->st_mtim.tv_nsec ||
+      sh->sh_confSize != confStat->st_size)
+    return(FAILURE);
+  if (sh->sh_checksum != HashBuffer(&map[off], mapLen - off, 0))
+    return(FAILURE);
+
+  if (sh->sh_numServices < 1 ||
+      !SnapSectionOK(sh, sh->sh_servicesOff, sh->sh_numServices, 
+		     sizeof(SnapService)) ||
+      !SnapSectionOK(sh, sh->sh_backendsOff, sh->sh_numBackends, 
+		     sizeof(SnapBackend)) ||
+      !SnapSectionOK(sh, sh->sh_slicesOff, sh->sh_numSlices, sizeof(int)) ||
+      !SnapSectionOK(sh, sh->sh_optLinesOff, sh->sh_numOptLines, 
+		     sizeof(int)) ||
+      !SnapSectionOK(sh, sh->sh_nodesOff, sh->sh_numNodes, 
+		     sizeof(RadixNode)) ||
+      !SnapSectionOK(sh, sh->sh_labelsOff, sh->sh_labelsLen, 1) ||
+      !SnapSectionOK(sh, sh->sh_stringsOff, sh->sh_stringsLen, 1))
+    return(FAILURE);
+  if (sh->sh_stringsLen < 1 || 
+      map[sh->sh_stringsOff + sh->sh_stringsLen - 1] != '\0' ||
+      !SnapStringOK(sh, sh->sh_netflowName, TRUE))
+    return(FAILURE);
+
+  sliceNames = (int *) &map[sh->sh_slicesOff];
+  for (i = 0; i < sh->sh_numSlices; i++) {
+    if (!SnapStringOK(sh, sliceNames[i], FALSE))
+      return(FAILURE);
+  }
+  optLines = (int *) &map[sh->sh_optLinesOff];
+  for (i = 0; i < sh->sh_numOptLines; i++) {
+    if (!SnapStringOK(sh, optLines[i], FALSE))
+      return(FAILURE);
+  }
+  sb = (SnapBackend *) &map[sh->sh_backendsOff];
+  for (i = 0; i < sh->sh_numBackends; i++) {
+    /* whatever SetBackendAddr would refuse */
+    if (sb[i].sb_weight < 1 || sb[i].sb_weight > BACKEND_WEIGHT_MAX ||
+	!SnapStringOK(sh, sb[i].sb_path, TRUE) ||
+	!SnapStringOK(sh, sb[i].sb_host, TRUE) ||
+	(sb[i].sb_path >= 0 && sb[i].sb_host >= 0))
+      return(FAILURE);
+    if (sb[i].sb_path < 0 && (sb[i].sb_port < 1 || sb[i].sb_port > 65535 ||
+			      sb[i].sb_port == DEMUX_PORT))
+      return(FAILURE);
+    if (sb[i].sb_path >= 0 && 
+	(map[sh->sh_stringsOff + sb[i].sb_path] != '/' ||
+	 strlen(&map[sh->sh_stringsOff + sb[i].sb_path]) >= 
+	 sizeof(((struct sockaddr_un *) 0)->sun_path)))
+      return(FAILURE);
+  }
+  sv = (SnapService *) &map[sh->sh_servicesOff];
+  for (i = 0; i < sh->sh_numServices; i++) {
+    if (!SnapStringOK(sh, sv[i].sv_line, FALSE) ||
+	!SnapStringOK(sh, sv[i].sv_host, FALSE) ||
+	!SnapStringOK(sh, sv[i].sv_slice, FALSE) ||
+	!SnapStringOK(sh, sv[i].sv_prefix, TRUE) ||
+	!SnapStringOK(sh, sv[i].sv_probePath, TRUE) ||
+	!SnapStringOK(sh, sv[i].sv_sockOpts, TRUE) ||
+	sv[i].sv_balance < BALANCE_LEASTCONN || 
+	sv[i].sv_balance > BALANCE_HASH_IP ||
+	sv[i].sv_probe < PROBE_NONE || sv[i].sv_probe > PROBE_HTTP ||
+	(sv[i].sv_strip != FALSE && sv[i].sv_strip != TRUE) ||
+	(sv[i].sv_tls != FALSE && sv[i].sv_tls != TRUE) ||
+	(sv[i].sv_fastOpen != FALSE && sv[i].sv_fastOpen != TRUE) ||
+	(sv[i].sv_probe == PROBE_HTTP && sv[i].sv_probePath < 0) ||
+	(sv[i].sv_probe != PROBE_NONE && sv[i].sv_probeInterval < 1) ||
+	sv[i].sv_poolSize < 0 || sv[i].sv_poolSize > POOL_MAX ||
+	(sv[i].sv_poolSize > 0 && sv[i].sv_poolIdle < 1) ||
+	sv[i].sv_tunnelIdle < 1 ||
+	sv[i].sv_numBackends < 1 || sv[i].sv_backends < 0 ||
+	sv[i].sv_backends > sh->sh_numBackends - sv[i].sv_numBackends ||
+	sv[i].sv_slicePos < 0 || sv[i].sv_slicePos >= sh->sh_numSlices)
+      return(FAILURE);
+  }
+  rn = (RadixNode *) &map[sh->sh_nodesOff];
+  if (sh->sh_hostRoot < 0 || sh->sh_hostRoot >= sh->sh_numNodes)
+    return(FAILURE);
+  for (i = 0; i < sh->sh_numNodes; i++) {
+    if (rn[i].rn_label < 0 || rn[i].rn_labelLen < 0 ||
+	rn[i].rn_label + rn[i].rn_labelLen > sh->sh_labelsLen ||
+	rn[i].rn_child < RADIX_NONE || rn[i].rn_child >= sh->sh_numNodes ||
+	rn[i].rn_sibling < RADIX_NONE || 
+	rn[i].rn_sibling >= sh->sh_numNodes)
+      return(FAILURE);
+  }
+  visited = xcalloc(sh->sh_numNodes, 1);
+  i = CheckSnapNode(sh, rn, sh->sh_hostRoot, TRUE, visited);
+  xfree(visited);
+  return(i);
+}
+/*-----------------------------------------------------------------*/
+static int
+LoadSnapshot(struct stat *confStat)
+{
+  /* maps the snapshot and uses it in place - nothing is parsed and
+     no strings are copied. services whose line didn't change are
+     kept as they are */
+  struct stat statBuf;
+  SnapHeader *sh;
+  SnapService *sv;
+  SnapBackend *sb;
+  SnapMap *sm;
+  ConfTable *ct;
+  int *sliceNames;
+  int *optLines;
+  char *strs;
+  char *map;
+  int fd, i, j;
+  int numKept = 0;
+
+  if ((fd = open(SNAP_FILE, O_RDONLY)) < 0)
+    return(FAILURE);
+  if (fstat(fd, &statBuf) != 0 || statBuf.st_size < sizeof(SnapHeader)) {
+    close(fd);
+    return(FAILURE);
+  }
+  map = mmap(NULL, statBuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return(FAILURE);
+  if (CheckSnapshot(map, statBuf.st_size, confStat) != SUCCESS) {
+    fprintf(stderr, "ignoring stale or bad %s\n", SNAP_FILE);
+    munmap(map, statBuf.st_size);
+    return(FAILURE);
+  }
+
+  sh = (SnapHeader *) map;
+  sv = (SnapService *) &map[sh->sh_servicesOff];
+  sb = (SnapBackend *) &map[sh->sh_backendsOff];
+  sliceNames = (int *) &map[sh->sh_slicesOff];
+  optLines = (int *) &map[sh->sh_optLinesOff];
+  strs = &map[sh->sh_stringsOff];
+
+  sm = xcalloc(1, sizeof(SnapMap));
+  sm->sm_refs = 1;		/* for the table's index */
+  sm->sm_addr = map;
+  sm->sm_len = statBuf.st_size;
+
+  confGen++;
+  ct = xcalloc(1, sizeof(ConfTable));
+  /* option lines are few and small, so they're just parsed again */
+  for (i = 0; i < sh->sh_numOptLines; i++)
+    ParseOptionLine(ct, xstrdup(&strs[optLines[i]]));
+  for (i = 0; i < sh->sh_numServices; i++) {
+    char *line = &strs[sv[i].sv_line];
+    unsigned int hash = HashString(line, 0, FALSE, FALSE);
+    char *sliceName = &strs[sliceNames[sv[i].sv_slicePos]];
+    ServiceSig *ss;
+
+    if ((ss = ConfTableFindLine(curConf, line, hash)) != NULL) {
+      ss->ss_refs++;
+      ss->ss_gen = confGen;
+      ConfTableAdd(ct, ss);
+      numKept++;
+      continue;
+    }
+
+    ss = xcalloc(1, sizeof(ServiceSig));
+    ss->ss_refs = 1;
+    ss->ss_gen = confGen;
+    ss->ss_map = sm;
+    sm->sm_refs++;
+    ss->ss_line = line;
+    ss->ss_lineHash = hash;
+    ss->ss_host = &strs[sv[i].sv_host];
+    ss->ss_slice = &strs[sv[i].sv_slice];
+    ss->ss_prefix = (sv[i].sv_prefix < 0) ? NULL : &strs[sv[i].sv_prefix];
+    /* backends keep live counts, so they can't stay in the map */
+    ss->ss_numBackends = sv[i].sv_numBackends;
+    ss->ss_backends = xcalloc(ss->ss_numBackends, sizeof(Backend));
+    for (j = 0; j < ss->ss_numBackends; j++) {
+      SnapBackend *snapBe = &sb[sv[i].sv_backends + j];
+      Backend *be = &ss->ss_backends[j];
+      struct in_addr addr;
+      addr.s_addr = snapBe->sb_addr;
+      if (snapBe->sb_host >= 0)
+	SetBackendHost(be, &strs[snapBe->sb_host], snapBe->sb_port);
+      else
+	SetBackendAddr(be, addr, snapBe->sb_port, (snapBe->sb_path < 0) ?
+		       NULL : &strs[snapBe->sb_path]);
+      be->be_weight = snapBe->sb_weight;
+      be->be_healthy = TRUE;
+      be->be_probeFd = -1;
+      be->be_idleFd = -1;
+    }
+    ss->ss_balance = sv[i].sv_balance;
+    BuildRing(ss);
+    ss->ss_strip = sv[i].sv_strip;
+    ss->ss_probe = sv[i].sv_probe;
+    ss->ss_probePath = (sv[i].sv_probePath < 0) ? NULL : 
+      &strs[sv[i].sv_probePath];
+    ss->ss_probeInterval = sv[i].sv_probeInterval;
+    ss->ss_poolSize = sv[i].sv_poolSize;
+    ss->ss_poolIdle = sv[i].sv_poolIdle;
+    ss->ss_tunnelIdle = sv[i].sv_tunnelIdle;
+    ss->ss_tls = sv[i].sv_tls;
+    ss->ss_fastOpen = sv[i].sv_fastOpen;
+    ss->ss_sockOpts = (sv[i].sv_sockOpts < 0) ? NULL : 
+      &strs[sv[i].sv_sockOpts];
+    /* slices never get reordered, so the snapshot's slice table
+       usually lines up with ours and we can skip the search */
+    ss->ss_slicePos = SliceRef(sliceName, sv[i].sv_slicePos);
+    if (slices[ss->ss_slicePos].si_inUse == 0 &&
+	slices[ss->ss_slicePos].si_xid < 1)
+      anySliceXidsNeeded = TRUE; /* if new/inactive, we need xid */
+    ConfTableAdd(ct, ss);
+  }
+
+  ct->ct_index.rt_nodes = (RadixNode *) &map[sh->sh_nodesOff];
+  ct->ct_index.rt_numNodes = sh->sh_numNodes;
+  ct->ct_index.rt_labels = &map[sh->sh_labelsOff];
+  ct->ct_index.rt_labelsUsed = sh->sh_labelsLen;
+  ct->ct_hostRoot = sh->sh_hostRoot;
+  ct->ct_map = sm;
+
+  if (domainNamePLCNetflow != NULL) {
+    xfree(domainNamePLCNetflow);
+    domainNamePLCNetflow = NULL;
+  }
+  if (sh->sh_netflowName >= 0)
+    domainNamePLCNetflow = xstrdup(&strs[sh->sh_netflowName]);
+  SwapConfTable(ct, numKept);
+
+  fprintf(stderr, "loaded %d services from %s\n", ct->ct_numServices, 
+	  SNAP_FILE);
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static ServiceSig *
+ParseServiceLine(char *line, unsigned int hash)
+{
+  /* makes a service out of a conf line, or returns NULL. on success
+     the service keeps the line */
+  ServiceSig serv, *ss;
+  struct in_addr defAddr;
+  char *defHost = NULL, *defPath = NULL;
+  int whichWord, res, isRoot;
+  char *word;
+
+  memset(&serv, 0, sizeof(serv));
+  if (WordCount(line) < 3) {
+    fprintf(stderr, "bad line: %s\n", line);
+    return(NULL);
+  }
+  word = GetWord(line, 0);
+  isRoot = (strcmp(word, "*") == 0);
+  if (word[0] == '%') {
+    /* only the conf file has option lines */
+    fprintf(stderr, "option line is not a service: %s\n", line);
+    xfree(word);
+    return(NULL);
+  }
+  xfree(word);
+
+  /* the optional ip or host name comes first, then any options. the
+     root line may have a netflow domain name where the ip would be */
+  defAddr.s_addr = htonl(INADDR_LOOPBACK);
+  for (whichWord = 3; (word = GetWord(line, whichWord)) != NULL;
+       whichWord++) {
+    if (ParseServiceOption(&serv, word) == SUCCESS)
+      ;
+    else if (whichWord == 3 && strncmp(word, "unix:", 5) == 0) {
+      defPath = word;
+      continue;
+    }
+    else if (whichWord == 3 && isRoot)
+      inet_aton(word, &defAddr);
+    else if (whichWord == 3 && inet_aton(word, &defAddr) == 0) {
+      defHost = word;
+      continue;
+    }
+    else if (whichWord != 3)
+      fprintf(stderr, "bad option %s: %s\n", word, line);
+    xfree(word);
+  }
+
+  word = GetWord(line, 2);
+  res = ParseBackends(&serv, word, defAddr, defHost, 
+		      defPath ? defPath + 5 : NULL);
+  if (defHost != NULL)
+    xfree(defHost);
+  if (defPath != NULL)
+    xfree(defPath);
+  if (res != SUCCESS) {
+    fprintf(stderr, "bad port: %s\n", line);
+    xfree(word);
+    if (serv.ss_probePath != NULL)
+      xfree(serv.ss_probePath);
+    if (serv.ss_sockOpts != NULL)
+      xfree(serv.ss_sockOpts);
+    return(NULL);
+  }
+  xfree(word);
+  if (serv.ss_probe != PROBE_NONE && serv.ss_probeInterval == 0)
+    serv.ss_probeInterval = PROBE_INTERVAL;
+  if (serv.ss_tls && serv.ss_poolSize > 0) {
+    fprintf(stderr, "pool ignored for tls: %s\n", line);
+    serv.ss_poolSize = 0;
+  }
+  if (serv.ss_poolSize > 0 && serv.ss_poolIdle == 0)
+    serv.ss_poolIdle = POOL_IDLE;
+  if (serv.ss_tunnelIdle == 0)
+    serv.ss_tunnelIdle = TUNNEL_IDLE;
+  BuildRing(&serv);
+
+  serv.ss_host = GetWord(line, 0);
+  serv.ss_slice = GetWord(line, 1);
+
+  /* split off any path prefix - "/" alone means no prefix */
+  if ((word = strchr(serv.ss_host, '/')) != NULL) {
+    int len;
+    serv.ss_prefix = StrdupLower(word);
+    *word = '\0';
+    len = strlen(serv.ss_prefix);
+    while (len > 0 && serv.ss_prefix[len-1] == '/')
+      serv.ss_prefix[--len] = '\0';
+    if (len == 0) {
+      xfree(serv.ss_prefix);
+      serv.ss_prefix = NULL;
+    }
+    if (serv.ss_host[0] == '\0')
+      strcpy(serv.ss_host, "*");
+  }
+  if (serv.ss_tls && serv.ss_prefix != NULL) {
+    /* only the host is visible in a ClientHello */
+    fprintf(stderr, "prefix ignored for tls: %s\n", line);
+    xfree(serv.ss_prefix);
+    serv.ss_prefix = NULL;
+  }
+
+  serv.ss_refs = 1;
+  serv.ss_gen = confGen;
+  serv.ss_line = line;
+  serv.ss_lineHash = hash;
+  serv.ss_slicePos = SliceRef(serv.ss_slice, -1);
+  if (slices[serv.ss_slicePos].si_inUse == 0 &&
+      slices[serv.ss_slicePos].si_xid < 1)
+    anySliceXidsNeeded = TRUE; /* if new/inactive, we need xid */
+  ss = xcalloc(1, sizeof(ServiceSig));
+  *ss = serv;
+  return(ss);
+}
+/*-----------------------------------------------------------------*/
+static void
+ReadConfFile(int snapChanged)
+{
+  /* if snapChanged is set, a new snapshot of an unchanged conf
+     file is picked up as well */
+  ConfTable *ct;
+  FILE *f;
+  char *line = NULL;
+  char *netflowName = NULL;
+  struct stat statBuf;
+  int numKept = 0;
+
+  if (stat(CONF_FILE, &statBuf) != 0) {
+    fprintf(stderr, "failed stat on codemux.conf\n");
+    if (curConf != NULL)
+      return;
+    exit(-1);
+  }
+  if (curConf != NULL && SameFile(&statBuf, &confFileStat)) {
+    if (snapChanged && (!compileOnly))
+      LoadSnapshot(&statBuf);
+    return;
+  }
+
+  if ((!compileOnly) && LoadSnapshot(&statBuf) == SUCCESS) {
+    confFileStat = statBuf;
+    return;
+  }
+
+  if ((f = fopen(CONF_FILE, "r")) == NULL) {
+    fprintf(stderr, "failed reading codemux.conf\n");
+    if (curConf != NULL)
+      return;
+    exit(-1);
+  }
+
+  /* conf file entries look like
+     coblitz.codeen.org princeton_coblitz 3125
+     coblitz.codeen.org/cdn princeton_coblitz 3126 127.0.0.1 strip
+  */
+
+  confGen++;
+  ct = xcalloc(1, sizeof(ConfTable));
+  while (1) {
+    ServiceSig *ss;
+    unsigned int hash;
+    if (line != NULL)
+      xfree(line);
+    
+    if ((line = GetNextLine(f)) == NULL)
+      break;
+
+    if (ParseOptionLine(ct, line)) {
+      line = NULL;		/* the table keeps it */
+      continue;
+    }
+
+    /* a line we already have needs no work at all */
+    hash = HashString(line, 0, FALSE, FALSE);
+    if ((ss = ConfTableFindLine(curConf, line, hash)) != NULL) {
+      ss->ss_refs++;
+      ss->ss_gen = confGen;
+      numKept++;
+      goto add_service;
+    }
+
+    if ((ss = ParseServiceLine(line, hash)) == NULL)
+      continue;
+    line = NULL;		/* the service keeps it */
+
+  add_service:
+    if (ct->ct_numServices == 0) {
+      /* the first row must be an entry for apache */
+      if (strcmp(ss->ss_host, "*") != 0 ||
+	  strcmp(ss->ss_slice, "root") != 0 || ss->ss_tls) {
+	fprintf(stderr, "first row has to be for webserver\n");
+	exit(-1);
+      }
+      /* see if there's PLC netflow's domain name */
+      netflowName = GetWord(ss->ss_line, 3);
+    }
+    ConfTableAdd(ct, ss);
+  }
+
+  fclose(f);
+
+#if 0
+  /* Faiyaz asked me to allow a single-entry codemux conf */
+  if (ct->ct_numServices == 1) {
+    if (curConf == NULL) {
+      fprintf(stderr, "nothing found in codemux.conf\n");
+      exit(-1);
+    }
+    return;
+  }
+#endif
+  if (ct->ct_numServices < 1) {
+    fprintf(stderr, "no entry found in codemux.conf\n");
+    exit(-1);
+  }
+
+  /* build the new table aside, then swap it in */
+  BuildRouteIndex(ct);
+  if (domainNamePLCNetflow != NULL)
+    xfree(domainNamePLCNetflow);
+  domainNamePLCNetflow = netflowName;
+  SwapConfTable(ct, numKept);
+  confFileStat = statBuf;
+}
+/*-----------------------------------------------------------------*/
+static char *err400BadRequest =
+"HTTP/1.0 400 Bad Request\r\n"
+"Content-Type: text/html\r\n"
+"\r\n"
+"You are trying to access a PlanetLab node, and your\n"
+"request header exceeded the allowable size. Please\n"
+"try again if you believe this error is temporary.\n";
+/*-----------------------------------------------------------------*/
+static char *err503Unavailable =
+"HTTP/1.0 503 Service Unavailable\r\n"
+"Content-Type: text/html\r\n"
+"\r\n"
+"You are trying to access a PlanetLab node, but the service\n"
+"seems to be unavailable at the moment. Please try again.\n";
+/*-----------------------------------------------------------------*/
+static char *err503Shed =
+"HTTP/1.0 503 Service Unavailable\r\n"
+"Retry-After: 1\r\n"
+"Content-Length: 0\r\n"
+"\r\n";
+/*-----------------------------------------------------------------*/
+static char *err503TooBusy =
+"HTTP/1.0 503 Service Unavailable\r\n"
+"Content-Type: text/html\r\n"
+"\r\n"
+"You are trying to access a PlanetLab node, but the service\n"
+"seems to be overloaded at the moment. Please try again.\n";
+/*-----------------------------------------------------------------*/
+static void
+SetFd(int fd, OurFDSet *set)
+{
+  if (highestSetFd < fd)
+    highestSetFd = fd;
+  FD_SET(fd, set);
+}
+/*-----------------------------------------------------------------*/
+static void
+ClearFd(int fd, OurFDSet *set)
+{
+  FD_CLR(fd, set);
+}
+/*-----------------------------------------------------------------*/
+static int
+RemoveHeader(char *lower, char *real, int totalSize, char *header)
+{
+  /* returns number of characters removed */
+  char h2[256];
+  int start, end, len;
+  char *temp, *conn;
+
+  sprintf(h2, "\n%s", header);
+
+  if ((conn = strstr(lower, h2)) == NULL)
+    return(0);
+
+  conn++;
+  /* determine how many characters to remove */
+  if ((temp = strchr(conn, '\n')) != NULL)
+    len = (temp - conn) + 1;
+  else
+    len = strlen(conn) + 1;
+  start = conn - lower;
+  end = start + len;
+  memmove(&real[start], &real[end], totalSize - end);
+  memmove(&lower[start], &lower[end], totalSize - end);
+
+  return(len);
+}
+/*-----------------------------------------------------------------*/
+static int
+InsertHeader(char *buf, int totalSize, char *header)
 {
   /* returns number of bytes inserted */
   
-  char h2[256];
-  char *temp;
-  int len;
+  char h2[256];
+  char *temp;
+  int len;
+  
+  sprintf(h2, "%s\r\n", header);
+  len = strlen(h2);
+
+  /* if we don't encounter a \n, it means that we have only a single
+     line, and we'd converted the \n to a \0 */
+  if ((temp = strchr(buf, '\n')) == NULL)
+    temp = strchr(buf, '\0');
+  temp++;
+  
+  memmove(temp + len, temp, totalSize - (temp - buf));
+  memcpy(temp, h2, len);
+  
+  return(len);
+}
+/*-----------------------------------------------------------------*/
+typedef struct RouteMatch {
+  ConfTable *rm_conf;		/* table being searched */
+  const char *rm_path;		/* request path, in the lowercased header */
+  int rm_pathLen;
+  int rm_service;		/* earliest matching service, or -1 */
+  int rm_matchLen;		/* length of its path prefix */
+} RouteMatch;
+/*-----------------------------------------------------------------*/
+static int
+RoutePathMatch(int whichService, int matchLen, void *arg)
+{
+  RouteMatch *rm = arg;
+
+  /* a prefix only matches whole path segments */
+  if (matchLen > 0 && matchLen < rm->rm_pathLen &&
+      rm->rm_path[matchLen] != '/' && rm->rm_path[matchLen] != '?')
+    return(FALSE);
+
+  /* the longest path prefix wins, then the earliest line */
+  if (rm->rm_service < 0 || matchLen > rm->rm_matchLen ||
+      (matchLen == rm->rm_matchLen && whichService < rm->rm_service)) {
+    rm->rm_service = whichService;
+    rm->rm_matchLen = matchLen;
+  }
+  return(FALSE);
+}
+/*-----------------------------------------------------------------*/
+static int
+RouteHostMatch(int pathRoot, int matchLen, void *arg)
+{
+  RouteMatch *rm = arg;
+
+  RadixWalkPrefixes(&rm->rm_conf->ct_index, pathRoot, 
+		    rm->rm_path, rm->rm_pathLen, RoutePathMatch, rm);
+  return(FALSE);
+}
+/*-----------------------------------------------------------------*/
+static int
+FindService(FlowBuf *fb, int *whichService, SockInfo *si, int isUpgrade)
+{
+  char *end;
+  char lowerBuf[FB_ALLOCSIZE];
+  char hostKey[MAX_HOST_LEN];
+  int hostKeyLen = -1;
+  char *hostVal;
+  char *buf = fb->fb_buf;
+  char orig[256];
+  char *url;
+  RouteMatch rm;
+  ServiceSig *ss;
+
+  if (strstr(buf, "\n\r\n") == NULL && strstr(buf, "\n\n") == NULL)
+    return(FAILURE);
+
+  /* insert client info after first line */
+  sprintf(orig, "X-CoDemux-Client: %s", inet_ntoa(si->si_cliAddr));
+  fb->fb_used += InsertHeader(buf, fb->fb_used + 1, orig);
+    
+  /* get just the header, so we can work on it */
+  StrcpyLower(lowerBuf, buf);
+  if ((end = strstr(lowerBuf, "\n\r\n")) == NULL)
+    end = strstr(lowerBuf, "\n\n");
+  *end = '\0';
+  
+  /* remove any existing connection, keep-alive headers. ours goes
+     in once we know the service. an Upgrade needs the client's
+     Connection header as it is */
+  fb->fb_used -= RemoveHeader(lowerBuf, buf, fb->fb_used + 1, "keep-alive:");
+  if (!isUpgrade)
+    fb->fb_used -= RemoveHeader(lowerBuf, buf, fb->fb_used + 1, 
+				"connection:");
+
+  /* find the path in the request line - anything that isn't an
+     origin-form path is only routed by host */
+  memset(&rm, 0, sizeof(rm));
+  rm.rm_conf = curConf;
+  rm.rm_service = -1;
+  url = lowerBuf;
+  while (*url != '\0' && !isspace(*url))
+    url++;
+  while (*url == ' ' || *url == '\t')
+    url++;
+  if (*url == '/') {
+    rm.rm_path = url;
+    rm.rm_pathLen = strcspn(url, " \t\r\n");
+  }
+
+  /* isolate host */
+  if ((hostVal = strstr(lowerBuf, "\nhost:")) != NULL) {
+    hostVal += strlen("\nhost:");
+    if ((end = strchr(hostVal, '\n')) != NULL)
+      *end = '\0';
+    if ((end = strchr(hostVal, ':')) != NULL)
+      *end = '\0';
+    while (isspace(*hostVal))
+      hostVal++;
+    end = hostVal;
+    while (*end != '\0' && !isspace(*end))
+      end++;
+    if (end > hostVal)
+      hostKeyLen = ReverseHost(hostVal, end - hostVal, hostKey);
+  }
+
+  /* every host suffix and path prefix that matches gets considered.
+     the longest path prefix wins, and among those the earliest
+     service, so host-only rules behave as they always have. with no
+     host, only the "*" rules can match */
+  RadixWalkPrefixes(&curConf->ct_index, curConf->ct_hostRoot, hostKey, 
+		    MAX(hostKeyLen, 0), RouteHostMatch, &rm);
+
+  /* key for balance=hash-url. the path is hashed from the original
+     request line, since URLs are case sensitive */
+  si->si_urlHash = HashBuffer(hostKey, MAX(hostKeyLen, 0), 0);
+  if (rm.rm_path != NULL)
+    si->si_urlHash = HashBuffer(&buf[rm.rm_path - lowerBuf], rm.rm_pathLen,
+				si->si_urlHash);
+
+  /* default to first service */
+  *whichService = MAX(rm.rm_service, 0);
+  ss = curConf->ct_services[*whichService];
+
+  if (ss->ss_strip && rm.rm_matchLen > 0) {
+    /* strip the prefix but keep its leading slash. rather than
+       moving the rest of the buffer down, slide the method up and
+       start writing from there */
+    int pathPos = rm.rm_path - lowerBuf;
+    int stripLen = rm.rm_matchLen - 1;
+    if (rm.rm_matchLen < rm.rm_pathLen && rm.rm_path[rm.rm_matchLen] == '/')
+      stripLen++;
+    memmove(&buf[fb->fb_start + stripLen], &buf[fb->fb_start], 
+	    pathPos + 1 - fb->fb_start);
+    fb->fb_start += stripLen;
+  }
+
+  /* a pooled backend connection has to stay open after the reply.
+     with -k we ask for keep-alive regardless, since the client sees
+     the backend's answer */
+  if (!isUpgrade)
+    fb->fb_used += InsertHeader(buf, fb->fb_used + 1, 
+				(ss->ss_poolSize > 0 || clientKeepAlive) ?
+				"Connection: keep-alive" : "Connection: close");
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+#define SNI_FOUND     0
+#define SNI_NEED_MORE 1
+#define SNI_NONE      2		/* not TLS, or it names no server */
+/*-----------------------------------------------------------------*/
+static int
+SniHave(int pos, int need, int end, int len)
+{
+  /* whether need bytes at pos are in the record, and here yet */
+  if (pos + need > end)
+    return(SNI_NONE);
+  return((pos + need > len) ? SNI_NEED_MORE : SNI_FOUND);
+}
+/*-----------------------------------------------------------------*/
+static int
+FindSni(const unsigned char *buf, int len, char *name, int nameSize)
+{
+  /* finds the server name in a ClientHello. it has to be in the
+     first record, but only the part of the hello up to the name
+     needs to have arrived */
+  int pos, end, extEnd, res, type, extLen, nameLen;
+
+  if ((res = SniHave(0, 6, 6, len)) != SNI_FOUND)
+    return(res);
+  if (buf[0] != 22 || buf[1] != 3 || buf[5] != 1)
+    return(SNI_NONE);		/* not a handshake, or not a hello */
+  end = 5 + ((buf[3] << 8) | buf[4]);
+
+  /* skip the handshake header, version and random, then the
+     session id, cipher suites and compression methods */
+  pos = 5 + 4 + 2 + 32;
+  if ((res = SniHave(pos, 1, end, len)) != SNI_FOUND)
+    return(res);
+  pos += 1 + buf[pos];
+  if ((res = SniHave(pos, 2, end, len)) != SNI_FOUND)
+    return(res);
+  pos += 2 + ((buf[pos] << 8) | buf[pos+1]);
+  if ((res = SniHave(pos, 1, end, len)) != SNI_FOUND)
+    return(res);
+  pos += 1 + buf[pos];
+  if ((res = SniHave(pos, 2, end, len)) != SNI_FOUND)
+    return(res);
+  extEnd = MIN(end, pos + 2 + ((buf[pos] << 8) | buf[pos+1]));
+  pos += 2;
+
+  while (pos < extEnd) {
+    if ((res = SniHave(pos, 4, extEnd, len)) != SNI_FOUND)
+      return(res);
+    type = (buf[pos] << 8) | buf[pos+1];
+    extLen = (buf[pos+2] << 8) | buf[pos+3];
+    pos += 4;
+    if (type != 0) {		/* server_name */
+      pos += extLen;
+      continue;
+    }
+    /* the first name in the list, which has to be a host name */
+    if ((res = SniHave(pos, 5, extEnd, len)) != SNI_FOUND)
+      return(res);
+    nameLen = (buf[pos+3] << 8) | buf[pos+4];
+    if (buf[pos+2] != 0 || nameLen < 1 || nameLen >= nameSize)
+      return(SNI_NONE);
+    pos += 5;
+    if ((res = SniHave(pos, nameLen, extEnd, len)) != SNI_FOUND)
+      return(res);
+    memcpy(name, &buf[pos], nameLen);
+    name[nameLen] = '\0';
+    if (strlen(name) != nameLen)
+      return(SNI_NONE);
+    return(SNI_FOUND);
+  }
+  return(SNI_NONE);
+}
+/*-----------------------------------------------------------------*/
+static int
+RouteTlsMatch(int pathRoot, int matchLen, void *arg)
+{
+  RouteMatch *rm = arg;
+  int which;
+
+  /* a host has at most one TLS rule, and the earliest line among
+     the matching hosts wins, as it does for host-only rules */
+  which = RadixFind(&rm->rm_conf->ct_index, pathRoot, 
+		    TLS_ROUTE_KEY, sizeof(TLS_ROUTE_KEY) - 1);
+  if (which != RADIX_NONE && (rm->rm_service < 0 || which < rm->rm_service))
+    rm->rm_service = which;
+  return(FALSE);
+}
+/*-----------------------------------------------------------------*/
+static int
+FindTlsService(const char *name, SockInfo *si)
+{
+  /* returns the TLS service for the server name, or -1. there's no
+     default, since the root service only speaks HTTP */
+  char hostKey[MAX_HOST_LEN];
+  int hostKeyLen;
+  RouteMatch rm;
+
+  if ((hostKeyLen = ReverseHost(name, strlen(name), hostKey)) < 0)
+    return(-1);
+  memset(&rm, 0, sizeof(rm));
+  rm.rm_conf = curConf;
+  rm.rm_service = -1;
+  RadixWalkPrefixes(&curConf->ct_index, curConf->ct_hostRoot, hostKey,
+		    hostKeyLen, RouteTlsMatch, &rm);
+  si->si_urlHash = HashBuffer(hostKey, hostKeyLen, 0);
+  return(rm.rm_service);
+}
+/*-----------------------------------------------------------------*/
+static int
+FindHostService(const char *host, SockInfo *si)
+{
+  /* routes by host alone, the way FindService does when there's no
+     path to go by. host may be NULL, and may end in a port */
+  char hostKey[MAX_HOST_LEN];
+  int hostKeyLen = 0;
+  const char *end;
+  RouteMatch rm;
+
+  if (host != NULL) {
+    if ((end = strchr(host, ':')) == NULL)
+      end = host + strlen(host);
+    hostKeyLen = MAX(ReverseHost(host, end - host, hostKey), 0);
+  }
+  memset(&rm, 0, sizeof(rm));
+  rm.rm_conf = curConf;
+  rm.rm_service = -1;
+  RadixWalkPrefixes(&curConf->ct_index, curConf->ct_hostRoot, hostKey,
+		    hostKeyLen, RouteHostMatch, &rm);
+  si->si_urlHash = HashBuffer(hostKey, hostKeyLen, 0);
+  return(MAX(rm.rm_service, 0));
+}
+/*-----------------------------------------------------------------*/
+static int
+PickBackend(ServiceSig *ss, SockInfo *cli)
+{
+  Backend *be = ss->ss_backends;
+  int num = ss->ss_numBackends;
+  int best = -1;
+  int total = 0;
+  int i;
+
+  /* backends behind an open breaker are skipped, and if that
+     leaves none, we return -1 */
+  if (num == 1)
+    return(BackendUsable(&be[0]) ? 0 : -1);
+
+  /* a retry just moves on from where the first try went */
+  if (cli->si_tries > 0) {
+    for (; cli->si_tries < num; cli->si_tries++) {
+      i = (cli->si_firstBackend + cli->si_tries) % num;
+      if (BackendUsable(&be[i]))
+	return(i);
+    }
+    return(-1);
+  }
+
+  if (ss->ss_balance == BALANCE_HASH_URL)
+    return(RingLookup(ss, cli->si_urlHash));
+  if (ss->ss_balance == BALANCE_HASH_IP)
+    return(RingLookup(ss, HashBuffer((char *) &cli->si_cliAddr, 
+				     sizeof(cli->si_cliAddr), 0)));
+
+  if (ss->ss_balance == BALANCE_RR) {
+    /* smooth weighted round robin - heavier backends get more
+       turns, but not all in a row */
+    for (i = 0; i < num; i++) {
+      if (!BackendUsable(&be[i]))
+	continue;
+      be[i].be_current += be[i].be_weight;
+      total += be[i].be_weight;
+      if (best < 0 || be[i].be_current > be[best].be_current)
+	best = i;
+    }
+    if (best >= 0)
+      be[best].be_current -= total;
+    return(best);
+  }
+
+  /* fewest connections for its weight. the scan starts after the
+     last pick, so ties take turns */
+  for (i = 0; i < num; i++) {
+    int j = (ss->ss_nextBackend + i) % num;
+    if (!BackendUsable(&be[j]))
+      continue;
+    if (best < 0 || be[j].be_numConns * be[best].be_weight <
+	be[best].be_numConns * be[j].be_weight)
+      best = j;
+  }
+  if (best >= 0)
+    ss->ss_nextBackend = (best + 1) % num;
+  return(best);
+}
+/*-----------------------------------------------------------------*/
+static void
+BackendAttached(int sock, int origFD)
+{
+  /* bookkeeping for a backend connection now serving origFD. it
+     counts against the slice's tunnels if the client asked for an
+     Upgrade, whether or not the backend agrees */
+  SockInfo *si = &sockInfo[sock];
+
+  si->si_lastActive = now;
+  if (sockInfo[origFD].si_upgrade) {
+    si->si_tunnel = TRUE;
+    ServiceToSlice(si->si_service)->si_numTunnels++;
+    numTunnels++;
+  }
+}
+/*-----------------------------------------------------------------*/
+static int
+ConnectBackend(int origFD, ServiceSig *ss, int whichBackend)
+{
+  int sock;
+  Backend *be = &ss->ss_backends[whichBackend];
+  SockInfo *si;
+  int res;
+
+  /* create socket */
+  BackendRefresh(be);
+  if ((sock = socket(be->be_addr.ba_sa.sa_family, SOCK_STREAM, 0)) < 0) {
+    return(FAILURE);
+  }
+  
+  /* make socket non-blocking */
+  if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+    close(sock);
+    return(FAILURE);
+  }
+  /* before connect, so the buffer sizes shape the window scale */
+  ApplySockProfile(sock, ss);
+  
+  /* start connection process - we should be told that it's in
+     progress */
+  if (be->be_state == BREAKER_OPEN) {
+    be->be_state = BREAKER_HALF_OPEN;
+    be->be_numHalfOpened++;
+  }
+  if (be->be_state == BREAKER_HALF_OPEN)
+    be->be_trying = TRUE;
+  if (ss->ss_fastOpen && be->be_addr.ba_sa.sa_family == AF_INET) {
+    /* with a cookie, connect returns at once and the SYN goes out
+       with the first write, carrying the request */
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+  }
+  if ((res = connect(sock, &be->be_addr.ba_sa, be->be_addrLen)) != 0 && 
+      errno != EINPROGRESS) {
+    close(sock);
+    BackendFailed(be);
+    return(FAILURE);
+  }
+  if (res == 0 && ss->ss_fastOpen && be->be_addr.ba_sa.sa_family == AF_INET)
+    be->be_numFastOpen++;
+
+  SetFd(sock, &masterWriteSet); /* determine when connect finishes */
+  sockInfo[origFD].si_peerFd = sock;
+  si = &sockInfo[sock];
+  memset(si, 0, sizeof(SockInfo));
+  si->si_peerFd = origFD;
+  si->si_blocked = TRUE;	/* still connecting */
+  si->si_connecting = TRUE;
+  si->si_connectSince = now;
+  numConnecting++;
+  si->si_service = ss;
+  ss->ss_refs++;
+  si->si_backend = whichBackend;
+  be->be_numConns++;
+  si->si_writeBuf = sockInfo[origFD].si_readBuf;
+  sockInfo[origFD].si_readBuf->fb_refs++;
+  SliceConnsInc(ss);
+  if (ss->ss_poolSize > 0 && sockInfo[origFD].si_msg != NULL) {
+    si->si_msg = xmalloc(sizeof(HttpMsg));
+    HttpMsgInit(si->si_msg, TRUE);
+    si->si_msg->hm_noBody = sockInfo[origFD].si_msg->hm_isHead;
+  }
+  BackendAttached(sock, origFD);
+
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static int
+WriteAvailData(int fd)
+{
+  SockInfo *si = &sockInfo[fd];
+  FlowBuf *fb = si->si_writeBuf;
+  int res;
+
+  /* printf("trying to write fd %d\n", fd); */
+  if (fb->fb_used < 1 || si->si_blocked)
+    return(SUCCESS);
+
+  /* printf("trying to write %d bytes\n", fb->fb_used); */
+  /* write(STDOUT_FILENO, fb->fb_buf, fb->fb_used); */
+  if ((res = write(fd, &fb->fb_buf[fb->fb_start], 
+		   fb->fb_used - fb->fb_start)) > 0) {
+    fb->fb_used -= fb->fb_start + res;
+    if (fb->fb_used > 0) {
+      /* couldn't write all - assume blocked */
+      memmove(fb->fb_buf, &fb->fb_buf[fb->fb_start + res], fb->fb_used);
+      si->si_blocked = TRUE;
+      SetFd(fd, &masterWriteSet);
+    }
+    fb->fb_start = 0;
+    /* printf("wrote %d\n", res); */
+    return(SUCCESS);
+  }
+
+  /* we might have been full but didn't realize it, or a fast open
+     may still be connecting */
+  if (res == -1 && (errno == EAGAIN || errno == EINPROGRESS)) {
+    si->si_blocked = TRUE;
+    SetFd(fd, &masterWriteSet);
+    return(SUCCESS);
+  }
+
+  /* otherwise, assume the worst */
+  return(FAILURE);
+}
+/*-----------------------------------------------------------------*/
+static void
+HdrHeapSwap(int a, int b)
+{
+  int fd = hdrHeap[a];
+
+  hdrHeap[a] = hdrHeap[b];
+  hdrHeap[b] = fd;
+  sockInfo[hdrHeap[a]].si_hdrHeapPos = a + 1;
+  sockInfo[hdrHeap[b]].si_hdrHeapPos = b + 1;
+}
+/*-----------------------------------------------------------------*/
+static void
+HdrHeapUp(int pos)
+{
+  while (pos > 0 && 
+	 sockInfo[hdrHeap[pos]].si_hdrDeadline < 
+	 sockInfo[hdrHeap[(pos - 1) / 2]].si_hdrDeadline) {
+    HdrHeapSwap(pos, (pos - 1) / 2);
+    pos = (pos - 1) / 2;
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+HdrHeapDown(int pos)
+{
+  while (1) {
+    int child = pos * 2 + 1;
+    if (child >= hdrHeapLen)
+      return;
+    if (child + 1 < hdrHeapLen &&
+	sockInfo[hdrHeap[child + 1]].si_hdrDeadline < 
+	sockInfo[hdrHeap[child]].si_hdrDeadline)
+      child++;
+    if (sockInfo[hdrHeap[pos]].si_hdrDeadline <= 
+	sockInfo[hdrHeap[child]].si_hdrDeadline)
+      return;
+    HdrHeapSwap(pos, child);
+    pos = child;
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+HdrHeapRemove(int fd)
+{
+  int pos = sockInfo[fd].si_hdrHeapPos - 1;
+
+  if (pos < 0)
+    return;
+  sockInfo[fd].si_hdrHeapPos = 0;
+  if (pos == --hdrHeapLen)
+    return;
+  hdrHeap[pos] = hdrHeap[hdrHeapLen];
+  sockInfo[hdrHeap[pos]].si_hdrHeapPos = pos + 1;
+  HdrHeapUp(pos);
+  HdrHeapDown(pos);
+}
+/*-----------------------------------------------------------------*/
+static void
+HeaderDeadline(int fd, int level)
+{
+  SockInfo *si = &sockInfo[fd];
+
+  si->si_hdrDeadline = si->si_hdrStartMs + hdrGrace[level] * 1000LL +
+    si->si_hdrBytes * 1000LL / hdrMinRate[level];
+}
+/*-----------------------------------------------------------------*/
+static void
+HeaderWaitStart(int fd)
+{
+  SockInfo *si = &sockInfo[fd];
+
+  si->si_needsHeaderSince = now;
+  numNeedingHeaders++;
+  si->si_hdrStartMs = nowMs;
+  si->si_hdrBytes = 0;
+  HeaderDeadline(fd, hdrLevel);
+  hdrHeap[hdrHeapLen++] = fd;
+  si->si_hdrHeapPos = hdrHeapLen;
+  HdrHeapUp(hdrHeapLen - 1);
+}
+/*-----------------------------------------------------------------*/
+static void
+HeaderProgress(int fd, int len)
+{
+  /* more bytes only push the deadline out */
+  SockInfo *si = &sockInfo[fd];
+
+  si->si_hdrBytes += len;
+  HeaderDeadline(fd, hdrLevel);
+  if (si->si_hdrHeapPos > 0)
+    HdrHeapDown(si->si_hdrHeapPos - 1);
+}
+/*-----------------------------------------------------------------*/
+static void
+HeaderWaitEnd(int fd)
+{
+  SockInfo *si = &sockInfo[fd];
+
+  if (!si->si_needsHeaderSince)
+    return;
+  si->si_needsHeaderSince = 0;
+  numNeedingHeaders--;
+  HdrHeapRemove(fd);
+}
+/*-----------------------------------------------------------------*/
+static void
+Unqueue(int fd)
+{
+  SockInfo *si = &sockInfo[fd];
+  SliceInfo *slice = &slices[si->si_queuedOn - 1];
+
+  if (si->si_queuePrev)
+    sockInfo[si->si_queuePrev - 1].si_queueNext = si->si_queueNext;
+  else
+    slice->si_queueHead = si->si_queueNext;
+  if (si->si_queueNext)
+    sockInfo[si->si_queueNext - 1].si_queuePrev = si->si_queuePrev;
+  else
+    slice->si_queueTail = si->si_queuePrev;
+  slice->si_queueLen--;
+  numQueued--;
+  si->si_queuedOn = 0;
+  ServiceRelease(si->si_queuedService); /* may free the slice */
+  si->si_queuedService = NULL;
+}
+/*-----------------------------------------------------------------*/
+static OurFDSet socksToCloseVec;
+static int numSocksToClose;
+static int whichSocksToClose[TARG_SETSIZE];
+/*-----------------------------------------------------------------*/
+static void
+CloseSock(int fd)
+{
+  if (FD_ISSET(fd, &socksToCloseVec))
+    return;
+  SetFd(fd, &socksToCloseVec);
+  whichSocksToClose[numSocksToClose] = fd;
+  numSocksToClose++;
+}
+/*-----------------------------------------------------------------*/
+static void
+DecBuf(FlowBuf *buf)
+{
+  if (buf == NULL)
+    return;
+  buf->fb_refs--;
+  if (buf->fb_refs == 0) {
+    free(buf->fb_buf);
+    free(buf);
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+PoolUnlink(int fd)
+{
+  /* takes a parked connection out of its backend's pool */
+  SockInfo *si = &sockInfo[fd];
+  Backend *be = &si->si_service->ss_backends[si->si_backend];
+  int *walk;
+
+  for (walk = &be->be_idleFd; *walk >= 0; 
+       walk = &sockInfo[*walk].si_nextIdle) {
+    if (*walk == fd) {
+      *walk = si->si_nextIdle;
+      be->be_numIdle--;
+      numIdle--;
+      break;
+    }
+  }
+  si->si_idleSince = 0;
+}
+/*-----------------------------------------------------------------*/
+static void
+ReallyCloseSocks(void)
+{
+  int i;
+
+  memset(&socksToCloseVec, 0, sizeof(socksToCloseVec));
+
+  for (i = 0; i < numSocksToClose; i++) {
+    int fd = whichSocksToClose[i];
+    close(fd);
+    DecBuf(sockInfo[fd].si_readBuf);
+    DecBuf(sockInfo[fd].si_writeBuf);
+    DecBuf(sockInfo[fd].si_pipelined);
+    sockInfo[fd].si_pipelined = NULL;
+    ClearFd(fd, &masterReadSet);
+    ClearFd(fd, &masterWriteSet);
+    sockInfo[fd].si_throttled = FALSE;
+    if (sockInfo[fd].si_queuedOn)
+      Unqueue(fd);
+    if (sockInfo[fd].si_clientSlot > 0) {
+      clients[sockInfo[fd].si_clientSlot - 1].ce_conns--;
+      sockInfo[fd].si_clientSlot = 0;
+    }
+    HeaderWaitEnd(fd);
+    if (sockInfo[fd].si_msg != NULL) {
+      xfree(sockInfo[fd].si_msg);
+      sockInfo[fd].si_msg = NULL;
+    }
+    if (sockInfo[fd].si_probeService != NULL) {
+      ServiceSig *ss = sockInfo[fd].si_probeService;
+      Backend *be = &ss->ss_backends[sockInfo[fd].si_backend];
+      if (be->be_probeFd == fd) {
+	be->be_probeFd = -1;
+	numProbing--;
+      }
+      sockInfo[fd].si_probeService = NULL;
+      ServiceRelease(ss);
+    }
+    if (sockInfo[fd].si_service != NULL) {
+      ServiceSig *ss = sockInfo[fd].si_service;
+      Backend *be = &ss->ss_backends[sockInfo[fd].si_backend];
+      if (sockInfo[fd].si_tunnel) {
+	ServiceToSlice(ss)->si_numTunnels--;
+	numTunnels--;
+	sockInfo[fd].si_tunnel = FALSE;
+      }
+      if (sockInfo[fd].si_idleSince)
+	PoolUnlink(fd);		/* parked ones aren't counted */
+      else {
+	be->be_numConns--;
+	SliceConnsDec(ss);
+      }
+      if (sockInfo[fd].si_connecting) {
+	/* gave up before we knew - let another trial through */
+	sockInfo[fd].si_connecting = FALSE;
+	numConnecting--;
+	be->be_trying = FALSE;
+      }
+      ServiceRelease(ss);
+      sockInfo[fd].si_service = NULL;
+    }
+    /* KyoungSoo*/
+    if (sockInfo[fd].si_peerFd >= 0) {
+      sockInfo[sockInfo[fd].si_peerFd].si_peerFd = -1;
+    }
+  }
+  numSocksToClose = 0;
+}
+/*-----------------------------------------------------------------*/
+static int
+PoolPut(int fd)
+{
+  /* parks a backend connection whose reply is over. it stays in the
+     read set, so we notice if the backend closes it */
+  SockInfo *si = &sockInfo[fd];
+  ServiceSig *ss = si->si_service;
+  Backend *be = &ss->ss_backends[si->si_backend];
+
+  if (be->be_numIdle >= ss->ss_poolSize)
+    return(FAILURE);
+  DecBuf(si->si_readBuf);
+  DecBuf(si->si_writeBuf);
+  si->si_readBuf = NULL;
+  si->si_writeBuf = NULL;
+  si->si_peerFd = -1;
+  si->si_blocked = FALSE;
+  ClearFd(fd, &masterWriteSet);
+  SetFd(fd, &masterReadSet);
+  si->si_idleSince = now;
+  si->si_nextIdle = be->be_idleFd;
+  be->be_idleFd = fd;
+  be->be_numIdle++;
+  numIdle++;
+  be->be_numConns--;
+  SliceConnsDec(ss);
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static int
+PoolTake(int origFD, ServiceSig *ss, int whichBackend)
+{
+  /* hands the newest pooled connection to this client, if there's
+     one the backend hasn't closed yet */
+  Backend *be = &ss->ss_backends[whichBackend];
+  SockInfo *cli = &sockInfo[origFD];
+  SockInfo *si;
+  int sock;
+  char c;
+
+  while ((sock = be->be_idleFd) >= 0) {
+    si = &sockInfo[sock];
+    PoolUnlink(sock);
+    be->be_numConns++;
+    SliceConnsInc(ss);
+    if (recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)
+      break;
+    CloseSock(sock);		/* closed, or sent something unasked */
+  }
+  if (sock < 0)
+    return(FAILURE);
+
+  cli->si_peerFd = sock;
+  si->si_peerFd = origFD;
+  si->si_blocked = TRUE;	/* written once select says we can */
+  SetFd(sock, &masterWriteSet);
+  si->si_writeBuf = cli->si_readBuf;
+  cli->si_readBuf->fb_refs++;
+  HttpMsgInit(si->si_msg, TRUE);
+  si->si_msg->hm_noBody = (cli->si_msg != NULL && cli->si_msg->hm_isHead);
+  be->be_numReused++;
+  BackendAttached(sock, origFD);
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static int
+StartConnect(int origFD, ServiceSig *ss)
+{
+  /* tries each backend at most once for this client */
+  SockInfo *cli = &sockInfo[origFD];
+
+  if (cli->si_tries == 0)
+    ApplySockProfile(origFD, ss);
+  while (cli->si_tries < ss->ss_numBackends) {
+    int which = PickBackend(ss, cli);
+    if (which < 0)
+      break;			/* all open, fail without a syscall */
+    if (cli->si_tries == 0)
+      cli->si_firstBackend = which;
+    if (cli->si_msg != NULL && PoolTake(origFD, ss, which) == SUCCESS)
+      return(SUCCESS);
+    if (ConnectBackend(origFD, ss, which) == SUCCESS)
+      return(SUCCESS);
+    cli->si_tries++;
+  }
+  return(FAILURE);
+}
+/*-----------------------------------------------------------------*/
+static void
+HoldPipelined(int fd, int extraLen)
+{
+  /* moves whatever the client sent after its current request into
+     a buffer of its own, to be routed once this reply is over */
+  SockInfo *si = &sockInfo[fd];
+  FlowBuf *fb = si->si_readBuf;
+  FlowBuf *next = xcalloc(1, sizeof(FlowBuf));
+
+  next->fb_refs = 1;
+  next->fb_buf = xmalloc(FB_ALLOCSIZE);
+  memcpy(next->fb_buf, &fb->fb_buf[fb->fb_used - extraLen], extraLen);
+  next->fb_used = extraLen;
+  next->fb_buf[extraLen] = 0;
+  fb->fb_used -= extraLen;
+  fb->fb_buf[fb->fb_used] = 0;
+  si->si_pipelined = next;
+  si->si_msg->hm_extra = FALSE;	/* it no longer goes upstream */
+}
+/*-----------------------------------------------------------------*/
+static int
+SliceTooBusy(SliceInfo *slice, int isTunnel)
+{
+  /* no service can have more than some absolute max number of
+     connections, or more than its own limit if it has one. Also,
+     when we're too busy, start enforcing fairness across the
+     servers, by weight. a slice with no limits of its own may reach
+     its share, as it always could */
+  if (shedLevel >= SHED_REFUSE && slice->si_low)
+    return(TRUE);
+  if ((slice->si_maxConns > 0) ? slice->si_numConns >= slice->si_maxConns :
+      slice->si_numConns > SERVICE_MAX)
+    return(TRUE);
+  if (numTotalSliceConns > FAIRNESS_CUTOFF && slice->si_numConns > 0 &&
+      slice->si_numConns >= slice->si_minConns &&
+      (SlicePlain(slice) ? slice->si_numConns > slice->si_share :
+       slice->si_numConns >= slice->si_share))
+    return(TRUE);
+  return(isTunnel && slice->si_numTunnels >= 
+	 (slice->si_maxTunnels > 0 ? slice->si_maxTunnels : TUNNEL_MAX));
+}
+/*-----------------------------------------------------------------*/
+static void
+SetSliceXid(int fd, SliceInfo *slice)
+{
+  if (slice->si_xid > 0) {
+    static int first = 1;
+    setsockopt(fd, SOL_SOCKET, SO_SETXID, 
+	       &slice->si_xid, sizeof(slice->si_xid));
+    if (first) {
+      /* just to log it for once */
+      fprintf(stderr, "setsockopt() with XID = %d name = %s\n", 
+	      slice->si_xid, slice->si_sliceName);
+      first = 0;
+    }
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+StartService(int fd, ServiceSig *ss, int reply)
+{
+  /* the client is routed and there's room for it. reply says if it
+     can be sent an HTTP error */
+  SetSliceXid(fd, ServiceToSlice(ss));
+  HeaderWaitEnd(fd);
+  if (StartConnect(fd, ss) != SUCCESS) {
+    if (reply)
+      write(fd, err503Unavailable, strlen(err503Unavailable));
+    TRACE("CloseSock(): fd=%d StartConnect() failed\n", fd);
+    CloseSock(fd);
+  }
+}
+/*-----------------------------------------------------------------*/
+static int
+QueueConn(int fd, ServiceSig *ss, int reply)
+{
+  /* parks a routed client at the end of its slice's queue, if the
+     slice has one with room. it reads nothing more while it waits */
+  SockInfo *si = &sockInfo[fd];
+  SliceInfo *slice = ServiceToSlice(ss);
+
+  if (slice->si_queueLen >= slice->si_queueMax)
+    return(FAILURE);
+  HeaderWaitEnd(fd);
+  ClearFd(fd, &masterReadSet);
+  ss->ss_refs++;
+  si->si_queuedService = ss;
+  si->si_queuedOn = ss->ss_slicePos + 1;
+  si->si_queuedSince = nowMs;
+  si->si_queueReply = reply;
+  si->si_queueNext = 0;
+  si->si_queuePrev = slice->si_queueTail;
+  if (slice->si_queueTail)
+    sockInfo[slice->si_queueTail - 1].si_queueNext = fd + 1;
+  else
+    slice->si_queueHead = fd + 1;
+  slice->si_queueTail = fd + 1;
+  slice->si_queueLen++;
+  numQueued++;
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static void
+RunQueues(void)
+{
+  /* starts waiting clients in order as their slices get room, and
+     turns away the ones that waited too long. run after the closes,
+     which are what make room */
+  int i;
+
+  for (i = 0; numQueued > 0 && i < numSlices; i++) {
+    SliceInfo *slice = &slices[i];
+    int n = slice->si_queueLen;
+
+    while (n-- > 0 && slice->si_queueHead) {
+      int fd = slice->si_queueHead - 1;
+      SockInfo *si = &sockInfo[fd];
+      ServiceSig *ss = si->si_queuedService;
+      int reply = si->si_queueReply;
+
+      if (nowMs - si->si_queuedSince >= slice->si_queueWait * 1000LL) {
+	Unqueue(fd);
+	if (reply)
+	  write(fd, err503TooBusy, strlen(err503TooBusy));
+	TRACE("CloseSock(): fd=%d waited too long\n", fd);
+	CloseSock(fd);
+	numQueueTimeouts++;
+	continue;
+      }
+      if (SliceTooBusy(slice, si->si_upgrade))
+	break;
+      ss->ss_refs++;		/* the queue's ref goes with Unqueue */
+      Unqueue(fd);
+      StartService(fd, ss, reply);
+      ServiceRelease(ss);
+      numQueueDispatches++;
+    }
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+RouteH2(int fd)
+{
+  /* a client that starts right in with HTTP/2. its requests are
+     interleaved on one connection, so it's routed once, by the host
+     of the first request, and from then on relayed as it is, like
+     an Upgrade tunnel. with no host it goes where a request without
+     a Host header would */
+  SockInfo *si = &sockInfo[fd];
+  FlowBuf *fb = si->si_readBuf;
+  char name[MAX_HOST_LEN + 1];
+  int whichService, res;
+  SliceInfo *slice;
+  ServiceSig *ss;
+
+  if (fb->fb_used < H2_PREFACE_LEN)
+    return;
+  res = Http2FindAuthority((unsigned char *) fb->fb_buf, fb->fb_used,
+			   name, sizeof(name));
+  if (res == H2_NEED_MORE && fb->fb_used < FB_SIZE)
+    return;
+  whichService = FindHostService((res == H2_FOUND) ? name : NULL, si);
+  ss = curConf->ct_services[whichService];
+  slice = ServiceToSlice(ss);
+  si->si_upgrade = TRUE;
+  if (SliceTooBusy(slice, TRUE)) {
+    if (QueueConn(fd, ss, FALSE) == SUCCESS)
+      return;
+    TRACE("CloseSock(): fd=%d too busy\n", fd);
+    CloseSock(fd);
+    return;
+  }
+  StartService(fd, ss, FALSE);
+}
+/*-----------------------------------------------------------------*/
+#define STATUS_REQ "GET /codemux/status.txt"
+/*-----------------------------------------------------------------*/
+static void
+RouteRequest(int fd)
+{
+  /* called as a request header comes in. once it's all here, the
+     request is routed and a backend connection started */
+  SockInfo *si = &sockInfo[fd];
+  FlowBuf *fb = si->si_readBuf;
+  HttpMsg req;
+  int whichService, used, extraLen;
+  SliceInfo *slice;
+  ServiceSig *ss;
+
+  if (si->si_numRequests == 0 && strncmp(fb->fb_buf, H2_PREFACE, 
+			MIN(fb->fb_used, H2_PREFACE_LEN)) == 0) {
+    RouteH2(fd);
+    return;
+  }
+
+  if (strncasecmp(fb->fb_buf, STATUS_REQ, sizeof(STATUS_REQ)-1) == 0) {
+    StrBuf sb;
+    memset(&sb, 0, sizeof(sb));
+    DumpStatus(&sb);
+    write(fd, sb.sb_buf, sb.sb_used);
+    StrBufFree(&sb);
+    CloseSock(fd);
+    return;
+  }
+
+  /* follow the request from its own bytes, before FindService
+     rewrites its header. anything after it is another request */
+  HttpMsgInit(&req, FALSE);
+  used = HttpMsgFeed(&req, &fb->fb_buf[fb->fb_start], 
+		     fb->fb_used - fb->fb_start);
+  extraLen = fb->fb_used - fb->fb_start - used;
+
+  //    printf("trying to find service\n");
+  if (FindService(fb, &whichService, si, req.hm_upgrade) != SUCCESS)
+    return;
+  //    printf("found service %d\n", whichService);
+  slice = ServiceToSlice(curConf->ct_services[whichService]);
+
+  /* if it needs to be redirected to PLC, let it be handled here */
+  if (whichService == 0 && domainNamePLCNetflow != NULL &&
+      strcmp(slice->si_sliceName, "root") == 0) {
+    char msg[1024];
+    int len;
+    static const char* resp302 = 
+      "HTTP/1.0 302 Found\r\n"
+      "Location: http://%s\r\n"
+      "Cache-Control: no-cache, no-store\r\n"
+      "Content-type: text/html\r\n"
+      "Connection: close\r\n"
+      "\r\n"
+      "Your request is being redirected to PLC Netflow http://%s\n";
+    len = snprintf(msg, sizeof(msg), resp302, 
+		   domainNamePLCNetflow, domainNamePLCNetflow);
+    write(fd, msg, len);
+    CloseSock(fd);
+    return;
+  }
+  si->si_upgrade = req.hm_upgrade;
+  ss = curConf->ct_services[whichService];
+  if (clientKeepAlive || ss->ss_poolSize > 0) {
+    /* keep following it, to know when the backend is done with it */
+    if (si->si_msg == NULL)
+      si->si_msg = xmalloc(sizeof(HttpMsg));
+    *si->si_msg = req;
+    if (clientKeepAlive && extraLen > 0)
+      HoldPipelined(fd, extraLen);
+  }
+  if (SliceTooBusy(slice, req.hm_upgrade)) {
+    if (QueueConn(fd, ss, TRUE) == SUCCESS)
+      return;
+    write(fd, err503TooBusy, strlen(err503TooBusy));
+    TRACE("CloseSock(): fd=%d too busy\n", fd);
+    CloseSock(fd);
+    return;
+  }
+  StartService(fd, ss, TRUE);
+}
+/*-----------------------------------------------------------------*/
+static void
+RouteTls(int fd)
+{
+  /* the TLS side of RouteRequest. the ClientHello is only looked
+     at, and goes upstream as it came. there's no way to send an
+     error, so anything unroutable is just closed */
+  SockInfo *si = &sockInfo[fd];
+  FlowBuf *fb = si->si_readBuf;
+  char name[MAX_HOST_LEN + 1];
+  int whichService, res;
+  SliceInfo *slice;
+  ServiceSig *ss;
+
+  res = FindSni((unsigned char *) fb->fb_buf, fb->fb_used, 
+		name, sizeof(name));
+  if (res == SNI_NEED_MORE && fb->fb_used < FB_SIZE)
+    return;
+  if (res != SNI_FOUND || (whichService = FindTlsService(name, si)) < 0) {
+    TRACE("CloseSock(): fd=%d no TLS service\n", fd);
+    CloseSock(fd);
+    return;
+  }
+  ss = curConf->ct_services[whichService];
+  slice = ServiceToSlice(ss);
+  if (SliceTooBusy(slice, FALSE)) {
+    if (QueueConn(fd, ss, FALSE) == SUCCESS)
+      return;
+    TRACE("CloseSock(): fd=%d too busy\n", fd);
+    CloseSock(fd);
+    return;
+  }
+  StartService(fd, ss, FALSE);
+}
+/*-----------------------------------------------------------------*/
+static void
+NextRequest(int fd)
+{
+  /* the reply is all written, and the client can send another
+     request. any it already sent is in si_pipelined */
+  SockInfo *si = &sockInfo[fd];
+
+  DecBuf(si->si_readBuf);
+  DecBuf(si->si_writeBuf);
+  si->si_readBuf = si->si_pipelined;
+  si->si_writeBuf = NULL;
+  si->si_pipelined = NULL;
+  si->si_keepAlive = FALSE;
+  si->si_blocked = FALSE;
+  si->si_tries = 0;
+  si->si_numRequests++;
+  HeaderWaitStart(fd);
+  ClearFd(fd, &masterWriteSet);
+  SetFd(fd, &masterReadSet);
+  if (si->si_readBuf != NULL)
+    RouteRequest(fd);
+}
+/*-----------------------------------------------------------------*/
+static void
+FinishConn(int fd)
+{
+  /* the peer is gone and everything has been written */
+  if (sockInfo[fd].si_keepAlive)
+    NextRequest(fd);
+  else
+    CloseSock(fd);
+}
+/*-----------------------------------------------------------------*/
+static void
+ResponseDone(int fd)
+{
+  /* the backend has sent its whole reply. the backend connection is
+     pooled if nothing else is owed on it, and the client either
+     waits for its next request or is closed once it has it all, as
+     if the backend had closed */
+  SockInfo *si = &sockInfo[fd];
+  HttpMsg *resp = si->si_msg;
+  int cliFd = si->si_peerFd;
+  HttpMsg *req = (cliFd >= 0) ? sockInfo[cliFd].si_msg : NULL;
+  int delimited, reuse;
+
+  delimited = !resp->hm_extra && resp->hm_keepAlive && req != NULL && 
+    req->hm_state == HM_DONE && si->si_writeBuf->fb_used == 0;
+  reuse = delimited && !req->hm_extra;
+
+  si->si_peerFd = -1;
+  if (!reuse || PoolPut(fd) != SUCCESS)
+    CloseSock(fd);
+  if (cliFd >= 0) {
+    sockInfo[cliFd].si_peerFd = -1;
+    sockInfo[cliFd].si_keepAlive = clientKeepAlive && delimited && 
+      req->hm_keepAlive;
+    if (sockInfo[cliFd].si_writeBuf->fb_used == 0)
+      FinishConn(cliFd);
+  }
+}
+/*-----------------------------------------------------------------*/
+static long long
+NowUs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+/*-----------------------------------------------------------------*/
+static void
+LoopLagUpdate(int busyUs, int ready)
+{
+  /* the lag and the ready backlog rise at once with a slow or busy
+     pass, and fall off slowly. a level is left only once the lag is
+     well under it. a backlog past "ready=" is at least a reject */
+  int level, i;
+
+  if (busyUs > loopLagUs)
+    loopLagUs = busyUs;
+  else
+    loopLagUs = (loopLagUs * 7 + busyUs) / 8;
+  if (ready > loopReady)
+    loopReady = ready;
+  else
+    loopReady = (loopReady * 7 + ready) / 8;
+
+  level = 0;
+  if (curConf->ct_shedReady > 0 &&
+      (loopReady >= curConf->ct_shedReady ||
+       (shedLevel > 0 && loopReady * 4 >= curConf->ct_shedReady * 3)))
+    level = SHED_REJECT;
+  for (i = 0; i < SHED_LEVELS; i++) {
+    int lagUs = curConf->ct_shedLag[i] * 1000;
+    if (lagUs > 0 && (loopLagUs >= lagUs ||
+		      (shedLevel > i && loopLagUs >= lagUs * 3 / 4)))
+      level = i + 1;
+  }
+  if (level != shedLevel)
+    fprintf(stderr, "loop lag %d us, shed level %d\n", loopLagUs, level);
+  shedLevel = level;
+}
+/*-----------------------------------------------------------------*/
+static SliceInfo *
+SockSlice(int fd)
+{
+  /* the backend side holds the service, the client side gets it
+     through its peer */
+  SockInfo *si = &sockInfo[fd];
+  ServiceSig *ss = si->si_service;
+
+  if (ss == NULL && si->si_peerFd >= 0)
+    ss = sockInfo[si->si_peerFd].si_service;
+  return((ss == NULL) ? NULL : ServiceToSlice(ss));
+}
+/*-----------------------------------------------------------------*/
+static int
+ShapeAllowance(int fd, int want)
+{
+  /* how much of want may be read now */
+  SockInfo *si = &sockInfo[fd];
+  SliceInfo *slice;
+
+  if (!anyShaping || (slice = SockSlice(fd)) == NULL)
+    return(want);
+  if (slice->si_rate > 0)
+    want = MIN(want, slice->si_tokens);
+  if (slice->si_connRate > 0) {
+    int depth = SHAPE_DEPTH(slice->si_connRate);
+    if (si->si_tokensAt == 0)
+      si->si_tokens = depth;	/* starts out full */
+    else
+      si->si_tokens = MIN(depth, si->si_tokens + slice->si_connRate * 
+			  (nowMs - si->si_tokensAt) / 1000);
+    si->si_tokensAt = nowMs;
+    want = MIN(want, si->si_tokens);
+  }
+  return(want);
+}
+/*-----------------------------------------------------------------*/
+static void
+ShapeCharge(int fd, int len)
+{
+  SliceInfo *slice;
+
+  if (!anyShaping || (slice = SockSlice(fd)) == NULL)
+    return;
+  if (slice->si_rate > 0)
+    slice->si_tokens -= len;
+  if (slice->si_connRate > 0)
+    sockInfo[fd].si_tokens -= len;
+}
+/*-----------------------------------------------------------------*/
+static void
+ShapeRun(void)
+{
+  /* tops up the slice buckets, and lets throttled sockets read
+     again once theirs have something. connection buckets are topped
+     up as they're used */
+  static long long lastRun;
+  int elapsed, ceiling, i;
+
+  elapsed = (lastRun == 0) ? 0 : nowMs - lastRun;
+  lastRun = nowMs;
+  for (i = 0; anyShaping && i < numSlices; i++) {
+    SliceInfo *si = &slices[i];
+    if (si->si_sliceName != NULL && si->si_rate > 0)
+      si->si_tokens = MIN(SHAPE_DEPTH(si->si_rate), si->si_tokens + 
+			  (long long) si->si_rate * elapsed / 1000);
+  }
+
+  ceiling = throttledCeiling;
+  throttledCeiling = 0;
+  for (i = 0; i < ceiling; i++) {
+    if (!sockInfo[i].si_throttled)
+      continue;
+    if (ShapeAllowance(i, FB_SIZE) > 0) {
+      sockInfo[i].si_throttled = FALSE;
+      SetFd(i, &masterReadSet);
+    }
+    else
+      throttledCeiling = i + 1;
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+SocketReadyToRead(int fd)
+{
+  SockInfo *si = &sockInfo[fd];
+  int spaceLeft;
+  FlowBuf *fb;
+  int res;
+
+  /* a kept-alive client's next request waits for this reply */
+  if (clientKeepAlive && si->si_service == NULL && si->si_msg != NULL &&
+      !si->si_needsHeaderSince && si->si_msg->hm_state == HM_DONE) {
+    ClearFd(fd, &masterReadSet);
+    return;
+  }
+
+  /* if peer is closed, close ourselves */
+  if (si->si_peerFd < 0 && (!si->si_needsHeaderSince)) {
+    CloseSock(fd);
+    return;
+  }
+
+  if ((fb = si->si_readBuf) == NULL) {
+    fb = si->si_readBuf = xcalloc(1, sizeof(FlowBuf));
+    fb->fb_refs = 1;
+    if (si->si_peerFd >= 0) {
+      sockInfo[si->si_peerFd].si_writeBuf = fb;
+      fb->fb_refs = 2;
+    }
+  }
+
+  if (fb->fb_buf == NULL)
+    fb->fb_buf = xmalloc(FB_ALLOCSIZE);
+
+  /* determine read buffer size - if 0, then block reads and return */
+  if ((spaceLeft = FB_SIZE - fb->fb_used) <= 0) {
+    if (si->si_needsHeaderSince) {
+      write(fd, err400BadRequest, strlen(err400BadRequest));
+      CloseSock(fd);
+      return;
+    }
+    else {
+      ClearFd(fd, &masterReadSet);
+      return;
+    }
+  } 
   
-  sprintf(h2, "%s\r\n", header);
-  len = strlen(h2);
+  /* a slice or connection over its rate waits for the timer */
+  if ((!si->si_needsHeaderSince) && 
+      (spaceLeft = ShapeAllowance(fd, spaceLeft)) <= 0) {
+    ClearFd(fd, &masterReadSet);
+    si->si_throttled = TRUE;
+    throttledCeiling = MAX(throttledCeiling, fd + 1);
+    return;
+  }
+
+  /* read as much as allowed, and is available */
+  if ((res = read(fd, &fb->fb_buf[fb->fb_used], spaceLeft)) == 0) {
+    CloseSock(fd);
+    if (fb->fb_used == 0 && si->si_peerFd >= 0) {
+      CloseSock(si->si_peerFd);
+      si->si_peerFd = -1;
+    }
+    return;
+  }
+  if (res == -1) {
+    if (errno == EAGAIN)
+      return;
+    TRACE("fd=%d errno=%d errstr=%s\n",fd, errno, strerror(errno));
+    CloseSock(fd);
+    if (fb->fb_used == 0 && si->si_peerFd >= 0) {
+      CloseSock(si->si_peerFd);
+      si->si_peerFd = -1;
+    }
+    return;
+  }
+  fb->fb_used += res;
+  fb->fb_buf[fb->fb_used] = 0;	/* terminate it for convenience */
+  si->si_lastActive = now;
+  if (!si->si_needsHeaderSince)
+    ShapeCharge(fd, res);
+  //  printf("sock %d, read %d, total %d\n", fd, res, fb->fb_used);
 
-  /* if we don't encounter a \n, it means that we have only a single
-     line, and we'd converted the \n to a \0 */
-  if ((temp = strchr(buf, '\n')) == NULL)
-    temp = strchr(buf, '\0');
-  temp++;
-  
-  memmove(temp + len, temp, totalSize - (temp - buf));
-  memcpy(temp, h2, len);
-  
-  return(len);
+  /* if we need header, check if we've gotten it. if so, do
+     modifications and continue. if not, check if we've read the
+     maximum, and if so, fail */
+  if (si->si_needsHeaderSince) {
+    HeaderProgress(fd, res);
+    if (si->si_tls)
+      RouteTls(fd);
+    else
+      RouteRequest(fd);
+    return;
+  }
+
+  /* keep track of where the request or reply ends */
+  if (si->si_msg != NULL) {
+    int used = HttpMsgFeed(si->si_msg, &fb->fb_buf[fb->fb_used - res], res);
+    if (used < res && clientKeepAlive && si->si_service == NULL)
+      HoldPipelined(fd, res - used);
+  }
+
+  /* write anything possible */
+  if (WriteAvailData(si->si_peerFd) != SUCCESS) {
+    /* assume the worst and close */
+    TRACE("CloseSock(): fd=%d WriteAvailData() failed errno=%d errstr=%s\n", 
+	  fd, errno, strerror(errno));
+    CloseSock(fd);
+    if (si->si_peerFd >=0) {
+      CloseSock(si->si_peerFd);
+      si->si_peerFd = -1;
+    }
+    return;
+  }
+
+  if (si->si_service != NULL && si->si_msg != NULL && 
+      si->si_msg->hm_state == HM_DONE)
+    ResponseDone(fd);
 }
 /*-----------------------------------------------------------------*/
-static int
-FindService(FlowBuf *fb, int *whichService, struct in_addr addr)
+static void
+RetryConnect(int fd)
 {
-  char *end;
-  char lowerBuf[FB_ALLOCSIZE];
-  char *hostVal;
-  char *buf = fb->fb_buf;
-  char orig[256];
-#if 0
-  char *url;
-  int i;
-  int len;
-#endif
+  /* the connect failed, so nothing has gone upstream yet, and the
+     client can quietly go to another backend */
+  SockInfo *si = &sockInfo[fd];
+  ServiceSig *ss = si->si_service;
+  int cliFd = si->si_peerFd;
 
-  if (strstr(buf, "\n\r\n") == NULL && strstr(buf, "\n\n") == NULL)
-    return(FAILURE);
+  si->si_peerFd = -1;		/* the client outlives this socket */
+  CloseSock(fd);
+  if (cliFd < 0)
+    return;
+  sockInfo[cliFd].si_peerFd = -1;
+  sockInfo[cliFd].si_tries++;
+  if (StartConnect(cliFd, ss) != SUCCESS) {
+    write(cliFd, err503Unavailable, strlen(err503Unavailable));
+    TRACE("CloseSock(): fd=%d no backend left\n", cliFd);
+    CloseSock(cliFd);
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+SocketReadyToWrite(int fd)
+{
+  SockInfo *si = &sockInfo[fd];
 
-  /* insert client info after first line */
-  sprintf(orig, "X-CoDemux-Client: %s", inet_ntoa(addr));
-  fb->fb_used += InsertHeader(buf, fb->fb_used + 1, orig);
-    
-  /* get just the header, so we can work on it */
-  StrcpyLower(lowerBuf, buf);
-  if ((end = strstr(lowerBuf, "\n\r\n")) == NULL)
-    end = strstr(lowerBuf, "\n\n");
-  *end = '\0';
+  if (si->si_connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    si->si_connecting = FALSE;
+    numConnecting--;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+      BackendFailed(&si->si_service->ss_backends[si->si_backend]);
+      RetryConnect(fd);
+      return;
+    }
+    BackendWorked(&si->si_service->ss_backends[si->si_backend]);
+  }
+
+  /* unblock it and read what it has */
+  si->si_blocked = FALSE;
+  ClearFd(fd, &masterWriteSet);
+  SetFd(fd, &masterReadSet);
   
-  /* remove any existing connection, keep-alive headers, add ours */
-  fb->fb_used -= RemoveHeader(lowerBuf, buf, fb->fb_used + 1, "keep-alive:");
-  fb->fb_used -= RemoveHeader(lowerBuf, buf, fb->fb_used + 1, "connection:");
-  fb->fb_used += InsertHeader(buf, fb->fb_used + 1, "Connection: close");
-  InsertHeader(lowerBuf, fb->fb_used + 1, "connection: close");
+  /* enable reading on peer just in case it was off */
+  if (si->si_peerFd >= 0)
+    SetFd(si->si_peerFd, &masterReadSet);
+    
+  /* if we have data, write it */
+  if (WriteAvailData(fd) != SUCCESS) {
+   /* assume the worst and close */
+    TRACE("CloseSock(): fd=%d WriteAvailData() failed errno=%d errstr=%s\n", 
+	  fd, errno, strerror(errno));
+    CloseSock(fd);
+    if (si->si_peerFd >= 0) {
+      CloseSock(si->si_peerFd);
+      si->si_peerFd = -1;
+    }
+    return;
+  }
 
-  /* isolate host, see if it matches */
-  if ((hostVal = strstr(lowerBuf, "\nhost:")) != NULL) {
+  /* if peer is closed and we're done writing, we should close */
+  if (si->si_peerFd < 0 && si->si_writeBuf->fb_used == 0) {
+    FinishConn(fd);
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+CloseReqlessConns(void)
+{
+  /* picks the level from how loaded we are, then closes whoever has
+     fallen behind its rate. a flood of header connections also gets
+     its slowest closed down to the level below, deadline or not */
+  int level, excess;
+
+  if (numTotalSliceConns + numNeedingHeaders > MAX_CONNS ||
+      numNeedingHeaders > TARG_SETSIZE/20) {
+    /* second condition is probably an attack - close aggressively */
+    level = 3;
+  }
+  else if (numTotalSliceConns + numNeedingHeaders > FAIRNESS_CUTOFF ||
+	   numNeedingHeaders > TARG_SETSIZE/40) {
+    /* sweep a little aggressively */
+    level = 2;
+  }
+  else if (numNeedingHeaders > TARG_SETSIZE/80) {
+    /* just sweep to close strays */
+    level = 1;
+  }
+  else {
+    /* too little gained - not worth sweeping */
+    level = 0;
+  }
+  if (hdrMinRate[level] != hdrMinRate[hdrLevel] ||
+      hdrGrace[level] != hdrGrace[hdrLevel]) {
+    /* the order changes with the rule, so rebuild the heap */
     int i;
-    hostVal += strlen("\nhost:");
-    if ((end = strchr(hostVal, '\n')) != NULL)
-      *end = '\0';
-    if ((end = strchr(hostVal, ':')) != NULL)
-      *end = '\0';
-    while (isspace(*hostVal))
-      hostVal++;
-    if (strlen(hostVal) > 0) {
-      hostVal = GetWord(hostVal, 0);
-      for (i = 1; i < numServices; i++) {
-	if (serviceSig[i].ss_host != NULL &&
-	    DoesDotlessSuffixMatch(hostVal, 0, serviceSig[i].ss_host)) {
-	  *whichService = i;
-	  free(hostVal);
-	  return(SUCCESS);
-	}
-      }
-      free(hostVal);
+    for (i = 0; i < hdrHeapLen; i++)
+      HeaderDeadline(hdrHeap[i], level);
+    for (i = hdrHeapLen / 2; i >= 0; i--)
+      HdrHeapDown(i);
+  }
+  hdrLevel = level;
+  if (level == 0)
+    return;
+
+  while (hdrHeapLen > 0 && sockInfo[hdrHeap[0]].si_hdrDeadline <= nowMs) {
+    int fd = hdrHeap[0];
+    HdrHeapRemove(fd);
+    CloseSock(fd);
+    numSlowEvictions++;
+  }
+
+  /* the closes happen at the end of the pass, so what's left in
+     the heap is what will still be waiting */
+  if (hdrHeapLen > TARG_SETSIZE/20) {
+    excess = hdrHeapLen - TARG_SETSIZE/40;
+    while (excess-- > 0) {
+      int fd = hdrHeap[0];
+      HdrHeapRemove(fd);
+      CloseSock(fd);
+      numPressureEvictions++;
     }
   }
+}
+/*-----------------------------------------------------------------*/
+static void
+CloseIdleConns(void)
+{
+  /* pooled connections and kept-alive clients only wait so long
+     for another request, and tunnels for traffic either way */
+  static int lastSweep;
+  int i;
 
-#if 0
-  /* see if URL prefix matches */
-  if ((end = strchr(lowerBuf, '\n')) != NULL)
-    *end = 0;
-  if ((url = GetField(lowerBuf, 1)) == NULL ||
-      url[0] != '/') {
-    /* bad request - let apache handle it ? */
-    *whichService = 0;
-    return(SUCCESS);
+  if (lastSweep == now || (numIdle == 0 && numTunnels == 0 && 
+			   !clientKeepAlive))
+    return;
+  lastSweep = now;
+
+  for (i = 0; i < highestSetFd+1; i++) {
+    SockInfo *si = &sockInfo[i];
+    if (si->si_idleSince &&
+	now - si->si_idleSince >= si->si_service->ss_poolIdle)
+      CloseSock(i);
+    else if (si->si_needsHeaderSince && si->si_numRequests > 0 &&
+	     now - si->si_needsHeaderSince >= KEEPALIVE_IDLE)
+      CloseSock(i);
+    else if (si->si_tunnel) {
+      int last = si->si_lastActive;
+      if (si->si_peerFd >= 0)
+	last = MAX(last, sockInfo[si->si_peerFd].si_lastActive);
+      if (now - last >= si->si_service->ss_tunnelIdle) {
+	CloseSock(i);
+	if (si->si_peerFd >= 0)
+	  CloseSock(si->si_peerFd);
+      }
+    }
   }
-  url++;			/* skip the leading slash */
-  for (i = 1; i < numServices; i++) {
-    if (serviceSig[i].ss_prefix != NULL &&
-	(len = strlen(serviceSig[i].ss_prefix)) > 0 &&
-	strncmp(url, serviceSig[i].ss_prefix, len) == 0 &&
-	(url[len] == ' ' || url[len] == '/')) {
-      int startPos = url - lowerBuf;
-      int stripLen = len + ((url[len] == '/') ? 1 : 0);
-      /* strip out prefix */
-      fb->fb_used -= stripLen;
-      memmove(&buf[startPos], &buf[startPos+stripLen], 
-	      fb->fb_used + 1 - startPos);
-      /* printf("%s", buf); */
-      *whichService = i;
-      return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static void
+CheckConnectTimeouts(void)
+{
+  /* a backend that never answers the connect counts as failed */
+  static int lastSweep;
+  int i;
+
+  if (lastSweep == now || numConnecting == 0)
+    return;
+  lastSweep = now;
+
+  for (i = 0; i < highestSetFd+1; i++) {
+    SockInfo *si = &sockInfo[i];
+    if (si->si_connecting && now - si->si_connectSince >= CONNECT_TIMEOUT &&
+	!FD_ISSET(i, &socksToCloseVec)) {
+      si->si_connecting = FALSE;
+      numConnecting--;
+      BackendFailed(&si->si_service->ss_backends[si->si_backend]);
+      RetryConnect(i);
     }
   }
-#endif
+}
+/*-----------------------------------------------------------------*/
+static void
+ProbeDone(int fd, int ok)
+{
+  SockInfo *si = &sockInfo[fd];
+  Backend *be = &si->si_probeService->ss_backends[si->si_backend];
 
-  /* default to first service */
-  *whichService = 0;
-  return(SUCCESS);
+  CloseSock(fd);
+  if (ok) {
+    be->be_probeFails = 0;
+    if (!be->be_healthy) {
+      be->be_healthy = TRUE;
+      fprintf(stderr, "backend %s passed probe\n", 
+	      be->be_name);
+    }
+    /* it takes connections, so there's no need to wait for a trial */
+    if (be->be_state != BREAKER_CLOSED)
+      BackendWorked(be);
+  }
+  else if (++be->be_probeFails >= PROBE_FALLS && be->be_healthy) {
+    be->be_healthy = FALSE;
+    fprintf(stderr, "backend %s failed probe\n", 
+	    be->be_name);
+  }
 }
 /*-----------------------------------------------------------------*/
-static int
-StartConnect(int origFD, int whichService)
+static void
+StartProbe(ServiceSig *ss, int whichBackend)
 {
-  int sock;
-  struct sockaddr_in dest;
+  Backend *be = &ss->ss_backends[whichBackend];
   SockInfo *si;
+  int sock;
 
-  /* create socket */
-  if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-    return(FAILURE);
-  }
-  
-  /* make socket non-blocking */
+  if (be->be_dns >= 0 && DnsLookup(be->be_dns, NULL) != SUCCESS)
+    return;			/* nothing to probe yet */
+  BackendRefresh(be);
+  if ((sock = socket(be->be_addr.ba_sa.sa_family, SOCK_STREAM, 0)) < 0)
+    return;
   if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
     close(sock);
-    return(FAILURE);
-  }
-  
-  /* set addr structure */
-  memset(&dest, 0, sizeof(dest));
-  dest.sin_family = AF_INET;
-  dest.sin_port = htons(serviceSig[whichService].ss_port);
-  if (serviceSig[whichService].ss_ip != NULL) {
-  	dest.sin_addr.s_addr = inet_addr(serviceSig[whichService].ss_ip);
-  } else {
-  	dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return;
   }
-
-  /* start connection process - we should be told that it's in
-     progress */
-  if (connect(sock, (struct sockaddr *) &dest, sizeof(dest)) != -1 || 
+  if (connect(sock, &be->be_addr.ba_sa, be->be_addrLen) != 0 && 
       errno != EINPROGRESS) {
+    /* treat it like any other failed probe */
     close(sock);
-    return(FAILURE);
+    if (++be->be_probeFails >= PROBE_FALLS && be->be_healthy) {
+      be->be_healthy = FALSE;
+      fprintf(stderr, "backend %s failed probe\n", 
+	      be->be_name);
+    }
+    return;
   }
 
-  SetFd(sock, &masterWriteSet); /* determine when connect finishes */
-  sockInfo[origFD].si_peerFd = sock;
   si = &sockInfo[sock];
   memset(si, 0, sizeof(SockInfo));
-  si->si_peerFd = origFD;
-  si->si_blocked = TRUE;	/* still connecting */
-  si->si_whichService = whichService;
-  si->si_writeBuf = sockInfo[origFD].si_readBuf;
-  sockInfo[origFD].si_readBuf->fb_refs++;
-  if (whichService >= 0)
-    SliceConnsInc(whichService);
-
-  return(SUCCESS);
+  si->si_peerFd = -1;
+  si->si_probeService = ss;
+  ss->ss_refs++;
+  si->si_backend = whichBackend;
+  be->be_probeFd = sock;
+  be->be_probeStarted = now;
+  be->be_probeUsed = 0;
+  numProbing++;
+  SetFd(sock, &masterWriteSet);
 }
 /*-----------------------------------------------------------------*/
-static int
-WriteAvailData(int fd)
+static void
+ProbeReady(int fd)
 {
+  /* a TCP probe passes once it connects. an HTTP probe then sends
+     its GET, and passes on a 2xx or 3xx status line */
   SockInfo *si = &sockInfo[fd];
-  FlowBuf *fb = si->si_writeBuf;
+  ServiceSig *ss = si->si_probeService;
+  Backend *be = &ss->ss_backends[si->si_backend];
   int res;
 
-  /* printf("trying to write fd %d\n", fd); */
-  if (fb->fb_used < 1 || si->si_blocked)
-    return(SUCCESS);
+  if (FD_ISSET(fd, &socksToCloseVec))
+    return;
 
-  /* printf("trying to write %d bytes\n", fb->fb_used); */
-  /* write(STDOUT_FILENO, fb->fb_buf, fb->fb_used); */
-  if ((res = write(fd, fb->fb_buf, fb->fb_used)) > 0) {
-    fb->fb_used -= res;
-    if (fb->fb_used > 0) {
-      /* couldn't write all - assume blocked */
-      memmove(fb->fb_buf, &fb->fb_buf[res], fb->fb_used);
-      si->si_blocked = TRUE;
-      SetFd(fd, &masterWriteSet);
+  if (FD_ISSET(fd, &masterWriteSet)) {
+    char req[1024];
+    int err = 0, reqLen;
+    socklen_t len = sizeof(err);
+
+    ClearFd(fd, &masterWriteSet);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+      ProbeDone(fd, FALSE);
+      return;
     }
-    /* printf("wrote %d\n", res); */
-    return(SUCCESS);
+    if (ss->ss_probe == PROBE_TCP) {
+      ProbeDone(fd, TRUE);
+      return;
+    }
+    reqLen = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n"
+		      "Host: %s\r\nUser-Agent: CoDemux/%s\r\n\r\n",
+		      ss->ss_probePath, 
+		      strcmp(ss->ss_host, "*") ? ss->ss_host : "localhost",
+		      CODEMUX_VERSION);
+    if (reqLen < 0 || reqLen >= sizeof(req) || 
+	write(fd, req, reqLen) != reqLen) {
+      ProbeDone(fd, FALSE);
+      return;
+    }
+    SetFd(fd, &masterReadSet);
+    return;
   }
 
-  /* we might have been full but didn't realize it */
-  if (res == -1 && errno == EAGAIN) {
-    si->si_blocked = TRUE;
-    SetFd(fd, &masterWriteSet);
-    return(SUCCESS);
+  res = read(fd, &be->be_probeBuf[be->be_probeUsed],
+	     sizeof(be->be_probeBuf) - 1 - be->be_probeUsed);
+  if (res < 0 && errno == EAGAIN)
+    return;
+  if (res > 0) {
+    be->be_probeUsed += res;
+    be->be_probeBuf[be->be_probeUsed] = '\0';
+    if (be->be_probeUsed < 12)
+      return;			/* "HTTP/1.x 200" isn't here yet */
   }
-
-  /* otherwise, assume the worst */
-  return(FAILURE);
+  ProbeDone(fd, be->be_probeUsed >= 12 &&
+	    strncmp(be->be_probeBuf, "HTTP/", 5) == 0 &&
+	    (be->be_probeBuf[9] == '2' || be->be_probeBuf[9] == '3'));
 }
 /*-----------------------------------------------------------------*/
-static OurFDSet socksToCloseVec;
-static int numSocksToClose;
-static int whichSocksToClose[TARG_SETSIZE];
-/*-----------------------------------------------------------------*/
 static void
-CloseSock(int fd)
+RunProbes(void)
 {
-  if (FD_ISSET(fd, &socksToCloseVec))
+  /* once a second, start any probes that are due and give up on
+     any that are taking too long. each backend's schedule is
+     jittered so they don't all go at once */
+  static int lastSweep;
+  int i, j;
+
+  if (lastSweep == now)
     return;
-  SetFd(fd, &socksToCloseVec);
-  whichSocksToClose[numSocksToClose] = fd;
-  numSocksToClose++;
+  lastSweep = now;
+
+  /* timeouts go by the probe's socket, not the conf, so a probe
+     whose service was removed while it was out still ends */
+  for (i = 0; numProbing > 0 && i <= highestSetFd; i++) {
+    ServiceSig *ss = sockInfo[i].si_probeService;
+    Backend *be;
+
+    if (ss == NULL)
+      continue;
+    be = &ss->ss_backends[sockInfo[i].si_backend];
+    if (be->be_probeFd == i && now - be->be_probeStarted >= 
+	MIN(PROBE_TIMEOUT, ss->ss_probeInterval))
+      ProbeDone(i, FALSE);
+  }
+
+  for (i = 0; i < curConf->ct_numServices; i++) {
+    ServiceSig *ss = curConf->ct_services[i];
+    int interval;
+
+    if (ss == NULL || ss->ss_probe == PROBE_NONE)
+      continue;
+    interval = ss->ss_probeInterval;
+    for (j = 0; j < ss->ss_numBackends; j++) {
+      Backend *be = &ss->ss_backends[j];
+
+      if (be->be_probeFd >= 0)
+	continue;
+      if (be->be_nextProbe == 0)
+	be->be_nextProbe = now + random() % interval;
+      if (be->be_nextProbe > now)
+	continue;
+      be->be_nextProbe = now + interval - interval/4 + 
+	random() % (interval/2 + 1);
+      StartProbe(ss, j);
+    }
+  }
 }
 /*-----------------------------------------------------------------*/
 static void
-DecBuf(FlowBuf *buf)
+WatchConfFiles(void)
 {
-  if (buf == NULL)
+  /* if any of this fails, we still poll every few minutes */
+  int mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE;
+
+  if ((confWatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    fprintf(stderr, "inotify failed, polling %s\n", CONF_FILE);
     return;
-  buf->fb_refs--;
-  if (buf->fb_refs == 0) {
-    free(buf->fb_buf);
-    free(buf);
   }
+  if ((confWatchWd = inotify_add_watch(confWatchFd, CONF_DIR, mask)) < 0)
+    fprintf(stderr, "inotify failed, polling %s\n", CONF_FILE);
+  if ((passwdWatchWd = inotify_add_watch(confWatchFd, "/etc", mask)) < 0)
+    fprintf(stderr, "inotify failed, polling /etc/passwd\n");
+  SetFd(confWatchFd, &masterReadSet);
 }
 /*-----------------------------------------------------------------*/
 static void
-ReallyCloseSocks(void)
+ReadConfEvents(void)
 {
-  int i;
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  int res;
 
-  memset(&socksToCloseVec, 0, sizeof(socksToCloseVec));
+  while ((res = read(confWatchFd, buf, sizeof(buf))) > 0) {
+    char *walk = buf;
+    while (walk < buf + res) {
+      struct inotify_event *ev = (struct inotify_event *) walk;
+      walk += sizeof(struct inotify_event) + ev->len;
 
-  for (i = 0; i < numSocksToClose; i++) {
-    int fd = whichSocksToClose[i];
-    close(fd);
-    DecBuf(sockInfo[fd].si_readBuf);
-    DecBuf(sockInfo[fd].si_writeBuf);
-    ClearFd(fd, &masterReadSet);
-    ClearFd(fd, &masterWriteSet);
-    if (sockInfo[fd].si_needsHeaderSince) {
-      sockInfo[fd].si_needsHeaderSince = 0;
-      numNeedingHeaders--;
-    }
-    if (sockInfo[fd].si_whichService >= 0) {
-      SliceConnsDec(sockInfo[fd].si_whichService);
-      sockInfo[fd].si_whichService = -1;
-    }
-    /* KyoungSoo*/
-    if (sockInfo[fd].si_peerFd >= 0) {
-      sockInfo[sockInfo[fd].si_peerFd].si_peerFd = -1;
+      if (ev->mask & IN_Q_OVERFLOW)
+	confEvents |= CONF_EV_CONF | CONF_EV_SNAP | CONF_EV_PASSWD;
+      if (ev->len == 0)
+	continue;
+      if (ev->wd == confWatchWd && strcmp(ev->name, CONF_NAME) == 0)
+	confEvents |= CONF_EV_CONF;
+      else if (ev->wd == confWatchWd && strcmp(ev->name, SNAP_NAME) == 0)
+	confEvents |= CONF_EV_SNAP;
+      else if (ev->wd == passwdWatchWd && strcmp(ev->name, "passwd") == 0)
+	confEvents |= CONF_EV_PASSWD;
     }
   }
-  numSocksToClose = 0;
 }
 /*-----------------------------------------------------------------*/
 static void
-SocketReadyToRead(int fd)
+OpenCtlSocket(void)
 {
-  SockInfo *si = &sockInfo[fd];
-  int spaceLeft;
-  FlowBuf *fb;
-  int res;
+  /* only reachable locally, and only by root */
+  struct sockaddr_un addr;
+  mode_t oldMask;
+  int sock, res;
 
-  /* if peer is closed, close ourselves */
-  if (si->si_peerFd < 0 && (!si->si_needsHeaderSince)) {
-    CloseSock(fd);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, CTL_SOCK, sizeof(addr.sun_path) - 1);
+
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    fprintf(stderr, "failed creating %s: %s\n", CTL_SOCK, strerror(errno));
     return;
   }
+  unlink(CTL_SOCK);		/* left over from the last child */
+  oldMask = umask(077);
+  res = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
+  umask(oldMask);
+  if (res < 0 || listen(sock, MAX_CTL_CONNS) < 0 ||
+      fcntl(sock, F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(sock, F_SETFD, FD_CLOEXEC) < 0) {
+    fprintf(stderr, "failed creating %s: %s\n", CTL_SOCK, strerror(errno));
+    close(sock);
+    return;
+  }
+  ctlLisSock = sock;
+  SetFd(ctlLisSock, &masterReadSet);
+}
+/*-----------------------------------------------------------------*/
+static void
+CtlClose(int which)
+{
+  CtlConn *cc = ctlConns[which];
 
-  if ((fb = si->si_readBuf) == NULL) {
-    fb = si->si_readBuf = xcalloc(1, sizeof(FlowBuf));
-    fb->fb_refs = 1;
-    if (si->si_peerFd >= 0) {
-      sockInfo[si->si_peerFd].si_writeBuf = fb;
-      fb->fb_refs = 2;
+  close(cc->cc_fd);
+  ClearFd(cc->cc_fd, &masterReadSet);
+  ClearFd(cc->cc_fd, &masterWriteSet);
+  StrBufFree(&cc->cc_out);
+  xfree(cc);
+  ctlConns[which] = NULL;
+}
+/*-----------------------------------------------------------------*/
+static char *
+CtlSetService(char *args, int isUpdate)
+{
+  /* args is a conf line. add wants a new host and prefix, update
+     replaces the service that has the same ones */
+  ConfTable *ct = curConf;
+  ServiceSig *ss, *old;
+  char *line = xstrdup(args);
+  int pos;
+
+  if ((ss = ParseServiceLine(line, HashString(line, 0, FALSE, FALSE))) 
+      == NULL) {
+    xfree(line);
+    return("bad service line");
+  }
+  FindSockProfile(ct, ss);
+  if (slices[ss->ss_slicePos].si_refs == 1)
+    ApplySliceConf(ct, ss->ss_slicePos); /* a new slice, not active */
+  pos = RouteIndexFind(ct, ss->ss_host, RouteKey(ss));
+
+  if (!isUpdate) {
+    if (pos != RADIX_NONE) {
+      ServiceRelease(ss);
+      return("service exists");
     }
+    ConfTableOwnIndex(ct);
+    ConfTableAdd(ct, ss);
+    RouteIndexAdd(ct, ct->ct_numServices - 1);
+    ConfTableHashLine(ct, ss);
+    return(NULL);
   }
 
-  if (fb->fb_buf == NULL)
-    fb->fb_buf = xmalloc(FB_ALLOCSIZE);
+  if (pos == RADIX_NONE) {
+    ServiceRelease(ss);
+    return("no such service");
+  }
+  if (pos == 0 && strcmp(ss->ss_slice, "root") != 0) {
+    ServiceRelease(ss);
+    return("default service must be for root");
+  }
+  /* same host and prefix, so the index doesn't change */
+  old = ct->ct_services[pos];
+  ConfTableUnhashLine(ct, old);
+  ct->ct_services[pos] = ss;
+  ConfTableHashLine(ct, ss);
+  ServiceRelease(old);
+  return(NULL);
+}
+/*-----------------------------------------------------------------*/
+static char *
+CtlRemoveService(char *args)
+{
+  /* args is host[/prefix], like the first word of a conf line, or
+     host and "tls" for a TLS service */
+  ConfTable *ct = curConf;
+  ServiceSig *ss;
+  char *host = GetWord(args, 0);
+  char *prefix, *word;
+  const char *key;
+  int pos, pathRoot;
 
-  /* determine read buffer size - if 0, then block reads and return */
-  if ((spaceLeft = FB_SIZE - fb->fb_used) <= 0) {
-    if (si->si_needsHeaderSince) {
-      write(fd, err400BadRequest, strlen(err400BadRequest));
-      CloseSock(fd);
-      return;
-    }
-    else {
-      ClearFd(fd, &masterReadSet);
-      return;
-    }
-  } 
-  
-  /* read as much as allowed, and is available */
-  if ((res = read(fd, &fb->fb_buf[fb->fb_used], spaceLeft)) == 0) {
-    CloseSock(fd);
-    if (fb->fb_used == 0 && si->si_peerFd >= 0) {
-      CloseSock(si->si_peerFd);
-      si->si_peerFd = -1;
-    }
-    return;
+  if (host == NULL)
+    return("no service given");
+  if ((prefix = strchr(host, '/')) != NULL) {
+    int len;
+    prefix = StrdupLower(prefix);
+    *strchr(host, '/') = '\0';
+    len = strlen(prefix);
+    while (len > 0 && prefix[len-1] == '/')
+      prefix[--len] = '\0';
+    if (host[0] == '\0')
+      strcpy(host, "*");
   }
-  if (res == -1) {
-    if (errno == EAGAIN)
-      return;
-    TRACE("fd=%d errno=%d errstr=%s\n",fd, errno, strerror(errno));
-    CloseSock(fd);
-    if (fb->fb_used == 0 && si->si_peerFd >= 0) {
-      CloseSock(si->si_peerFd);
-      si->si_peerFd = -1;
-    }
-    return;
+  else if ((word = GetWord(args, 1)) != NULL) {
+    if (strcasecmp(word, "tls") == 0)
+      prefix = xstrdup(TLS_ROUTE_KEY);
+    xfree(word);
   }
-  fb->fb_used += res;
-  fb->fb_buf[fb->fb_used] = 0;	/* terminate it for convenience */
-  //  printf("sock %d, read %d, total %d\n", fd, res, fb->fb_used);
+  pos = RouteIndexFind(ct, host, prefix);
+  pathRoot = RouteIndexFindPath(ct, host, FALSE);
+  xfree(host);
+  if (prefix != NULL)
+    xfree(prefix);
+  if (pos == RADIX_NONE)
+    return("no such service");
+  if (pos == 0)
+    return("cannot remove the default service");
 
-  /* if we need header, check if we've gotten it. if so, do
-     modifications and continue. if not, check if we've read the
-     maximum, and if so, fail */
-  if (si->si_needsHeaderSince) {
-    int whichService;
-    SliceInfo *slice;
+  ss = ct->ct_services[pos];
+  ConfTableOwnIndex(ct);
+  key = RouteKey(ss);
+  RadixInsert(&ct->ct_index, pathRoot, key, strlen(key), RADIX_NONE);
+  ConfTableUnhashLine(ct, ss);
+  ct->ct_services[pos] = NULL;
+  ct->ct_numHoles++;
+  ServiceRelease(ss);
+  return(NULL);
+}
+/*-----------------------------------------------------------------*/
+static char *
+CtlSetLimit(char *args)
+{
+  /* args is "slice maxConns [maxTunnels]", and 0 removes a limit */
+  char *slice = GetWord(args, 0);
+  char *max = GetField(args, 1);
+  char *maxTunnels = GetField(args, 2);
+  int pos;
 
-#define STATUS_REQ "GET /codemux/status.txt"
-    if (strncasecmp(fb->fb_buf, STATUS_REQ, sizeof(STATUS_REQ)-1) == 0) {
-      DumpStatus(fd);
-      CloseSock(fd);
-      return;
-    }
+  if (slice == NULL || max == NULL || !isdigit(*max) ||
+      (maxTunnels != NULL && !isdigit(*maxTunnels))) {
+    if (slice != NULL)
+      xfree(slice);
+    return("usage: limit <slice> <maxconns> [<maxtunnels>]");
+  }
+  pos = FindSlicePos(slice);
+  xfree(slice);
+  if (pos < 0)
+    return("no such slice");
+  slices[pos].si_maxConns = atoi(max);
+  if (maxTunnels != NULL)
+    slices[pos].si_maxTunnels = atoi(maxTunnels);
+  ComputeShares();
+  return(NULL);
+}
+/*-----------------------------------------------------------------*/
+static int
+CtlCommand(CtlConn *cc, char *line)
+{
+  /* runs one command, returns TRUE if it changed the services */
+  char *args, *err = NULL, *note = NULL;
+  int changed = FALSE;
 
-    //    printf("trying to find service\n");
-    if (FindService(fb, &whichService, si->si_cliAddr) != SUCCESS)
-      return;
-    //    printf("found service %d\n", whichService);
-    slice = ServiceToSlice(whichService);
-
-    /* if it needs to be redirected to PLC, let it be handled here */
-    if (whichService == 0 && domainNamePLCNetflow != NULL &&
-	strcmp(slice->si_sliceName, "root") == 0) {
-      char msg[1024];
-      int len;
-      static const char* resp302 = 
-	"HTTP/1.0 302 Found\r\n"
-	"Location: http://%s\r\n"
-	"Cache-Control: no-cache, no-store\r\n"
-	"Content-type: text/html\r\n"
-	"Connection: close\r\n"
-	"\r\n"
-	"Your request is being redirected to PLC Netflow http://%s\n";
-      len = snprintf(msg, sizeof(msg), resp302, 
-		     domainNamePLCNetflow, domainNamePLCNetflow);
-      write(fd, msg, len);
-      CloseSock(fd);
-      return;
-    }
-    /* no service can have more than some absolute max number of
-       connections. Also, when we're too busy, start enforcing
-       fairness across the servers */
-    if (slice->si_numConns > SERVICE_MAX ||
-	(numTotalSliceConns > FAIRNESS_CUTOFF && 
-	 slice->si_numConns > MAX_CONNS/numActiveSlices)) {
-      write(fd, err503TooBusy, strlen(err503TooBusy));
-      TRACE("CloseSock(): fd=%d too busy\n", fd);
-      CloseSock(fd);
-      return;
-    }
+  if ((args = strchr(line, '#')) != NULL)
+    *args = '\0';
+  while (isspace(*line))
+    line++;
+  if (*line == '\0')
+    return(FALSE);
+  args = line + strcspn(line, " \t");
+  if (*args != '\0')
+    *args++ = '\0';
+  while (isspace(*args))
+    args++;
 
-    if (slice->si_xid > 0) {
-      static int first = 1;
-      setsockopt(fd, SOL_SOCKET, SO_SETXID, 
-		 &slice->si_xid, sizeof(slice->si_xid));
-      if (first) {
-	/* just to log it for once */
-	fprintf(stderr, "setsockopt() with XID = %d name = %s\n", 
-		slice->si_xid, slice->si_sliceName);
-	first = 0;
-      }
-    }
+  if (strcasecmp(line, "add") == 0 || strcasecmp(line, "update") == 0) {
+    if ((err = CtlSetService(args, 
+			     strcasecmp(line, "update") == 0)) == NULL)
+      changed = TRUE;
+  }
+  else if (strcasecmp(line, "remove") == 0) {
+    if ((err = CtlRemoveService(args)) == NULL)
+      changed = TRUE;
+  }
+  else if (strcasecmp(line, "limit") == 0) {
+    /* ApplySliceConf puts the conf's limits back on any reload */
+    if ((err = CtlSetLimit(args)) == NULL)
+      note = "limit lasts until codemux.conf is reloaded";
+  }
+  else if (strcasecmp(line, "reload") == 0) {
+    /* forget the file we read, so it's read again, dropping anything
+       done through here */
+    memset(&confFileStat, 0, sizeof(confFileStat));
+    confEvents |= CONF_EV_CONF;
+  }
+  else if (strcasecmp(line, "stats") == 0)
+    DumpStatus(&cc->cc_out);
+  else
+    err = "unknown command";
 
-    si->si_needsHeaderSince = 0;
-    numNeedingHeaders--;
-    if (StartConnect(fd, whichService) != SUCCESS) {
-      write(fd, err503Unavailable, strlen(err503Unavailable));
-      TRACE("CloseSock(): fd=%d StartConnect() failed\n", fd);
-      CloseSock(fd);
-      return;
+  if (err != NULL)
+    StrBufPrintf(&cc->cc_out, "ERR %s\n", err);
+  else if (note != NULL)
+    StrBufPrintf(&cc->cc_out, "OK %s\n", note);
+  else
+    StrBufPrintf(&cc->cc_out, "OK\n");
+  return(changed);
+}
+/*-----------------------------------------------------------------*/
+static int
+CtlFlush(int which)
+{
+  /* returns FAILURE if the connection got closed */
+  CtlConn *cc = ctlConns[which];
+  int res;
+
+  if (cc->cc_outStart < cc->cc_out.sb_used) {
+    res = write(cc->cc_fd, &cc->cc_out.sb_buf[cc->cc_outStart],
+		cc->cc_out.sb_used - cc->cc_outStart);
+    if (res < 0 && errno != EAGAIN) {
+      CtlClose(which);
+      return(FAILURE);
     }
-    return;
+    if (res > 0)
+      cc->cc_outStart += res;
   }
-
-  /* write anything possible */
-  if (WriteAvailData(si->si_peerFd) != SUCCESS) {
-    /* assume the worst and close */
-    TRACE("CloseSock(): fd=%d WriteAvailData() failed errno=%d errstr=%s\n", 
-	  fd, errno, strerror(errno));
-    CloseSock(fd);
-    if (si->si_peerFd >=0) {
-      CloseSock(si->si_peerFd);
-      si->si_peerFd = -1;
+  if (cc->cc_outStart < cc->cc_out.sb_used) {
+    if (cc->cc_out.sb_used - cc->cc_outStart > CTL_OUT_MAX) {
+      /* not reading its replies */
+      CtlClose(which);
+      return(FAILURE);
     }
+    SetFd(cc->cc_fd, &masterWriteSet);
+    return(SUCCESS);
+  }
+
+  ClearFd(cc->cc_fd, &masterWriteSet);
+  cc->cc_out.sb_used = cc->cc_outStart = 0;
+  if (cc->cc_eof) {
+    CtlClose(which);
+    return(FAILURE);
   }
+  return(SUCCESS);
 }
 /*-----------------------------------------------------------------*/
 static void
-SocketReadyToWrite(int fd)
+CtlReadyToRead(int which)
 {
-  SockInfo *si = &sockInfo[fd];
+  /* all the commands that came in together are applied before the
+     next request is routed */
+  CtlConn *cc = ctlConns[which];
+  char *line, *end;
+  int numChanged = 0;
+  int res;
 
-  /* unblock it and read what it has */
-  si->si_blocked = FALSE;
-  ClearFd(fd, &masterWriteSet);
-  SetFd(fd, &masterReadSet);
-  
-  /* enable reading on peer just in case it was off */
-  if (si->si_peerFd >= 0)
-    SetFd(si->si_peerFd, &masterReadSet);
-    
-  /* if we have data, write it */
-  if (WriteAvailData(fd) != SUCCESS) {
-   /* assume the worst and close */
-    TRACE("CloseSock(): fd=%d WriteAvailData() failed errno=%d errstr=%s\n", 
-	  fd, errno, strerror(errno));
-    CloseSock(fd);
-    if (si->si_peerFd >= 0) {
-      CloseSock(si->si_peerFd);
-      si->si_peerFd = -1;
-    }
+  res = read(cc->cc_fd, &cc->cc_in[cc->cc_inUsed], 
+	     sizeof(cc->cc_in) - 1 - cc->cc_inUsed);
+  if (res < 0) {
+    if (errno != EAGAIN)
+      CtlClose(which);
     return;
   }
+  if (res == 0) {
+    /* the client may just be done sending - still answer it */
+    cc->cc_eof = TRUE;
+    ClearFd(cc->cc_fd, &masterReadSet);
+  }
+  cc->cc_inUsed += res;
+  cc->cc_in[cc->cc_inUsed] = '\0';
 
-  /* if peer is closed and we're done writing, we should close */
-  if (si->si_peerFd < 0 && si->si_writeBuf->fb_used == 0) {
-    CloseSock(fd);
+  line = cc->cc_in;
+  while ((end = strchr(line, '\n')) != NULL) {
+    *end = '\0';
+    if (end > line && end[-1] == '\r')
+      end[-1] = '\0';
+    numChanged += CtlCommand(cc, line);
+    line = end + 1;
+  }
+  cc->cc_inUsed -= line - cc->cc_in;
+  memmove(cc->cc_in, line, cc->cc_inUsed + 1);
+  if (cc->cc_eof && cc->cc_inUsed > 0) {
+    numChanged += CtlCommand(cc, cc->cc_in);
+    cc->cc_inUsed = 0;
   }
+  else if (cc->cc_inUsed >= sizeof(cc->cc_in) - 1) {
+    StrBufPrintf(&cc->cc_out, "ERR line too long\n");
+    cc->cc_eof = TRUE;
+    ClearFd(cc->cc_fd, &masterReadSet);
+  }
+
+  if (numChanged > 0) {
+    ConfTable *ct = curConf;
+    if (ct->ct_numHoles * 4 > ct->ct_numServices || 
+	(ct->ct_numHoles > 0 && ct->ct_numShadowed > 0))
+      ConfTableCompact(ct);
+    GetSliceXids();
+    fprintf(stderr, "conf changed: %d commands, %d services\n",
+	    numChanged, ct->ct_numServices - ct->ct_numHoles);
+  }
+  CtlFlush(which);
 }
 /*-----------------------------------------------------------------*/
 static void
-CloseReqlessConns(void)
+CtlAccept(void)
 {
-  static int lastSweep;
-  int maxAge;
+  int sock, i;
+
+  while ((sock = accept(ctlLisSock, NULL, NULL)) >= 0) {
+    for (i = 0; i < MAX_CTL_CONNS; i++) {
+      if (ctlConns[i] == NULL)
+	break;
+    }
+    if (i == MAX_CTL_CONNS || fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+      close(sock);
+      continue;
+    }
+    ctlConns[i] = xcalloc(1, sizeof(CtlConn));
+    ctlConns[i]->cc_fd = sock;
+    memset(&sockInfo[sock], 0, sizeof(SockInfo));
+    sockInfo[sock].si_peerFd = -1;
+    SetFd(sock, &masterReadSet);
+  }
+}
+/*-----------------------------------------------------------------*/
+static void
+CtlProcess(OurFDSet *readSet, OurFDSet *writeSet)
+{
+  /* handles the control sockets, and takes them out of the sets so
+     the main loop never sees them */
   int i;
 
-  if (lastSweep == now)
-    return;
-  lastSweep = now;
+  for (i = 0; i < MAX_CTL_CONNS; i++) {
+    CtlConn *cc = ctlConns[i];
+    int fd;
 
-  if (numTotalSliceConns + numNeedingHeaders > MAX_CONNS ||
-      numNeedingHeaders > TARG_SETSIZE/20) {
-    /* second condition is probably an attack - close aggressively */
-    maxAge = 5;
+    if (cc == NULL)
+      continue;
+    fd = cc->cc_fd;
+    if ((!FD_ISSET(fd, writeSet) || CtlFlush(i) == SUCCESS) &&
+	FD_ISSET(fd, readSet))
+      CtlReadyToRead(i);
+    ClearFd(fd, readSet);
+    ClearFd(fd, writeSet);
   }
-  else if (numTotalSliceConns + numNeedingHeaders > FAIRNESS_CUTOFF ||
-	   numNeedingHeaders > TARG_SETSIZE/40) {
-    /* sweep a little aggressively */
-    maxAge = 10;
+
+  if (ctlLisSock >= 0 && FD_ISSET(ctlLisSock, readSet)) {
+    ClearFd(ctlLisSock, readSet);
+    CtlAccept();
   }
-  else if (numNeedingHeaders > TARG_SETSIZE/80) {
-    /* just sweep to close strays */
-    maxAge = 30;
+}
+/*-----------------------------------------------------------------*/
+static int
+ClientAdmit(struct in_addr addr)
+{
+  /* counts a connect from addr. returns its slot in clients plus
+     one, 0 if it isn't tracked, or -1 if it's over a limit. the
+     connect rate is a sliding window, taking in the part of the
+     previous window that it still covers */
+  ConfTable *ct = curConf;
+  ClientEntry *ce = NULL;
+  unsigned int hash;
+  int i, slot, freeSlot = -1;
+  int age, recent;
+
+  if (ct->ct_clientConns == 0 && ct->ct_clientRate == 0)
+    return(0);
+  if (clients == NULL)
+    clients = xcalloc(CLIENT_TABLE_SIZE, sizeof(ClientEntry));
+
+  hash = HashBuffer((char *) &addr, sizeof(addr), 0);
+  for (i = 0; i < CLIENT_PROBE_MAX; i++) {
+    slot = (hash + i) & (CLIENT_TABLE_SIZE - 1);
+    if (clients[slot].ce_conns == 0 &&
+	now - clients[slot].ce_window >= 2 * CLIENT_WINDOW) {
+      if (freeSlot < 0)
+	freeSlot = slot;
+    }
+    else if (clients[slot].ce_addr == addr.s_addr) {
+      ce = &clients[slot];
+      break;
+    }
   }
-  else {
-    /* too little gained - not worth sweeping */
-    return;
+  if (ce == NULL) {
+    if (freeSlot < 0)
+      return(0);		/* too crowded here, let it be */
+    slot = freeSlot;
+    ce = &clients[slot];
+    memset(ce, 0, sizeof(ClientEntry));
+    ce->ce_addr = addr.s_addr;
+    ce->ce_window = now;
   }
 
-  /* if it's too old, close it */
-  for (i = 0; i < highestSetFd+1; i++) {
-    if (sockInfo[i].si_needsHeaderSince &&
-	(now - sockInfo[i].si_needsHeaderSince) > maxAge) 
-      CloseSock(i);
+  if ((age = now - ce->ce_window) >= CLIENT_WINDOW) {
+    ce->ce_prev = (age < 2 * CLIENT_WINDOW) ? ce->ce_cur : 0;
+    ce->ce_cur = 0;
+    ce->ce_window = now - age % CLIENT_WINDOW;
+    age = now - ce->ce_window;
   }
+  ce->ce_cur++;
+  recent = ce->ce_cur + 
+    ce->ce_prev * (CLIENT_WINDOW - age) / CLIENT_WINDOW;
+  if ((ct->ct_clientRate > 0 && recent > ct->ct_clientRate) ||
+      (ct->ct_clientConns > 0 && ce->ce_conns >= ct->ct_clientConns))
+    return(-1);
+  ce->ce_conns++;
+  return(slot + 1);
+}
+/*-----------------------------------------------------------------*/
+static void
+AcceptConns(int lisSock, int isTls)
+{
+  int newSock;
+
+  do {
+    struct sockaddr_in addr;
+    socklen_t lenAddr = sizeof(addr);
+    if ((newSock = accept(lisSock, (struct sockaddr *) &addr, 
+			  &lenAddr)) >= 0) {
+      int clientSlot;
+
+      /* while the loop is behind, new clients only get a quick no */
+      if (shedLevel >= SHED_REJECT) {
+	if (!isTls)
+	  write(newSock, err503Shed, strlen(err503Shed));
+	close(newSock);
+	numShedRejects++;
+	continue;
+      }
+      /* turn away an address over its limits before spending
+	 anything on it */
+      if ((clientSlot = ClientAdmit(addr.sin_addr)) < 0) {
+	close(newSock);
+	numClientRejects++;
+	continue;
+      }
+      /* make socket non-blocking */
+      if (fcntl(newSock, F_SETFL, O_NONBLOCK) < 0) {
+	if (clientSlot > 0)
+	  clients[clientSlot - 1].ce_conns--;
+	close(newSock);
+	continue;
+      }
+      memset(&sockInfo[newSock], 0, sizeof(SockInfo));
+      sockInfo[newSock].si_clientSlot = clientSlot;
+      HeaderWaitStart(newSock);
+      sockInfo[newSock].si_peerFd = -1;
+      sockInfo[newSock].si_cliAddr = addr.sin_addr;
+      sockInfo[newSock].si_tls = isTls;
+      SetFd(newSock, &masterReadSet);
+      if (listenFastOpen) {
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (getsockopt(newSock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+	    (info.tcpi_options & TCPI_OPT_SYN_DATA))
+	  numFastOpenAccepts++;
+      }
+    }
+  } while (newSock >= 0);
 }
 /*-----------------------------------------------------------------*/
 static void
@@ -920,19 +5113,28 @@ MainLoop(int lisSock)
   int lastConfCheck = 0;
 
   signal(SIGPIPE, SIG_IGN);
+  srandom(getpid() ^ time(NULL));	/* for probe jitter */
+  WatchConfFiles();
+  OpenCtlSocket();
 
   while (1) {
-    int newSock;
-    int ceiling;
+    int ceiling, tick;
+    long long startUs;
     struct timeval timeout;
 
     now = time(NULL);
 
-    if (now - lastConfCheck > 300) {
-      ReadConfFile();
+    /* reload as soon as we're told about a change, and poll every
+       so often in case the watch missed something */
+    if ((confEvents & (CONF_EV_CONF | CONF_EV_SNAP)) ||
+	now - lastConfCheck > 300) {
+      ReadConfFile(confEvents & CONF_EV_SNAP);
       GetSliceXids();		/* always call - in case new slices created */
       lastConfCheck = now;
     }
+    else if (confEvents & CONF_EV_PASSWD)
+      GetSliceXids();
+    confEvents = 0;
 
     /* see if there's any activity */
     tempReadSet = masterReadSet;
@@ -943,8 +5145,19 @@ MainLoop(int lisSock)
 	   (!FD_ISSET(highestSetFd, &tempReadSet)) &&
 	   (!FD_ISSET(highestSetFd, &tempWriteSet)))
       highestSetFd--;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
+    /* while accepts are deferred the listeners can't wake us */
+    if (shedLevel >= SHED_DEFER) {
+      ClearFd(lisSock, &tempReadSet);
+      if (tlsLisSock >= 0)
+	ClearFd(tlsLisSock, &tempReadSet);
+    }
+    /* throttled sockets, waiting clients and a shedding loop need a
+       finer timer, and closes left by RunQueues shouldn't wait at all */
+    tick = (throttledCeiling > 0 || numQueued > 0 || shedLevel > 0);
+    timeout.tv_sec = tick ? 0 : 1;
+    timeout.tv_usec = tick ? SHAPE_TICK_MS * 1000 : 0;
+    if (numSocksToClose > 0)
+      timeout.tv_sec = timeout.tv_usec = 0;
     res = select(highestSetFd+1, (fd_set *) &tempReadSet, 
 		 (fd_set *) &tempWriteSet, NULL, &timeout);
     if (res < 0 && errno != EINTR) {
@@ -953,47 +5166,65 @@ MainLoop(int lisSock)
     }
 
     now = time(NULL);
+    startUs = NowUs();
+    nowMs = startUs / 1000;
+    ShapeRun();
 
-    /* clear the bit for listen socket to avoid confusion */
+    /* clear the bit for listen sockets to avoid confusion */
     ClearFd(lisSock, &tempReadSet);
+    if (tlsLisSock >= 0)
+      ClearFd(tlsLisSock, &tempReadSet);
+
+    /* note any conf changes, we'll reload at the top of the loop */
+    if (confWatchFd >= 0 && FD_ISSET(confWatchFd, &tempReadSet)) {
+      ReadConfEvents();
+      ClearFd(confWatchFd, &tempReadSet);
+    }
+
+    /* control commands take effect before anything else is routed */
+    CtlProcess(&tempReadSet, &tempWriteSet);
     
     ceiling = highestSetFd+1;	/* copy it, since it changes during loop */
     /* pass data back and forth as needed */
     for (i = 0; i < ceiling; i++) {
-      if (FD_ISSET(i, &tempWriteSet))
+      if (!FD_ISSET(i, &tempWriteSet))
+	continue;
+      if (sockInfo[i].si_probeService != NULL)
+	ProbeReady(i);
+      else
 	SocketReadyToWrite(i);
     }
     for (i = 0; i < ceiling; i++) {
-      if (FD_ISSET(i, &tempReadSet))
+      if (!FD_ISSET(i, &tempReadSet))
+	continue;
+      if (sockInfo[i].si_probeService != NULL)
+	ProbeReady(i);
+      else
 	SocketReadyToRead(i);
     }
 
     /* see if we need to close conns w/o requests */
     CloseReqlessConns();
+    CheckConnectTimeouts();
+    CloseIdleConns();
+    RunProbes();
+    DnsRun(now);
     
     /* do all closes */
     ReallyCloseSocks();
+    RunQueues();
 
-    /* try accepting new connections */
-    do {
-      struct sockaddr_in addr;
-      socklen_t lenAddr = sizeof(addr);
-      if ((newSock = accept(lisSock, (struct sockaddr *) &addr, 
-			    &lenAddr)) >= 0) {
-	/* make socket non-blocking */
-	if (fcntl(newSock, F_SETFL, O_NONBLOCK) < 0) {
-	  close(newSock);
-	  continue;
-	}
-	memset(&sockInfo[newSock], 0, sizeof(SockInfo));
-	sockInfo[newSock].si_needsHeaderSince = now;
-	numNeedingHeaders++;
-	sockInfo[newSock].si_peerFd = -1;
-	sockInfo[newSock].si_cliAddr = addr.sin_addr;
-	sockInfo[newSock].si_whichService = -1;
-	SetFd(newSock, &masterReadSet);
-      }
-    } while (newSock >= 0);
+    /* try accepting new connections, unless we're too far behind
+       to take on more */
+    if (shedLevel < SHED_DEFER) {
+      AcceptConns(lisSock, FALSE);
+      if (tlsLisSock >= 0)
+	AcceptConns(tlsLisSock, TRUE);
+    }
+    else
+      numShedDeferrals++;
+
+    LoopLagUpdate(NowUs() - startUs, MAX(res, 0));
   }
 }
 /*-----------------------------------------------------------------*/
@@ -1071,14 +5302,27 @@ main(int argc, char *argv[])
   int lisSock;
   int logFd;
   int doDaemon = 1;
+  int doTls = 0;
   int opt;
   struct in_addr lisAddress = { .s_addr = htonl(INADDR_ANY) };
 
-  while ((opt = getopt(argc, argv, "dl:")) != -1) {
+  while ((opt = getopt(argc, argv, "cdfkl:s")) != -1) {
     switch (opt) {
+      case 'c':
+	compileOnly = TRUE;
+	break;
+      case 'f':
+	listenFastOpen = TRUE;
+	break;
+      case 'k':
+	clientKeepAlive = TRUE;
+	break;
       case 'd':
 	doDaemon = 0;
 	break;
+      case 's':
+	doTls = 1;
+	break;
       case 'l':
 	if (inet_pton(AF_INET, optarg, &lisAddress) <= 0) {
 	  fprintf(stderr, "`%s' is not a valid address\n", optarg);
@@ -1086,11 +5330,24 @@ main(int argc, char *argv[])
 	}
 	break;
       default:
-	fprintf(stderr, "Usage: %s [-d] [-l <listening address>]\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-c] [-d] [-f] [-k] [-s] "
+		"[-l <listening address>]\n", argv[0]);
 	exit(-1);
     }
   }
 
+  /* just compile the conf file into a snapshot */
+  if (compileOnly) {
+    struct stat statBuf;
+    ReadConfFile(FALSE);
+    if (stat(CONF_FILE, &statBuf) != 0 ||
+	WriteSnapshot(SNAP_FILE, &statBuf) != SUCCESS) {
+      fprintf(stderr, "failed writing %s\n", SNAP_FILE);
+      exit(-1);
+    }
+    exit(0);
+  }
+
   /* do the daemon stuff */
   if (doDaemon) {
     if (InitDaemon() < 0) {
@@ -1106,6 +5363,22 @@ main(int argc, char *argv[])
     exit(-1);
   }
   SetFd(lisSock, &masterReadSet);
+  if (doTls) {
+    if ((tlsLisSock = CreatePrivateAcceptSocket(TLS_PORT, TRUE,
+						&lisAddress)) < 0) {
+      fprintf(stderr, "failed creating TLS accept socket\n");
+      exit(-1);
+    }
+    SetFd(tlsLisSock, &masterReadSet);
+  }
+  if (listenFastOpen) {
+    int qlen = TFO_QLEN;
+    if (setsockopt(lisSock, IPPROTO_TCP, TCP_FASTOPEN, 
+		   &qlen, sizeof(qlen)) != 0 ||
+	(tlsLisSock >= 0 && setsockopt(tlsLisSock, IPPROTO_TCP, TCP_FASTOPEN,
+				       &qlen, sizeof(qlen)) != 0))
+      fprintf(stderr, "TCP fast open not available\n");
+  }
 
   /* open the log file */
   logFd = OpenLogFile();
@@ -10,6 +10,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
 #include "codemuxlib.h"
 #include "debug.h"
 
@@ -522,3 +523,58 @@ HashString(const char *name, unsigned int hash, int endOnQuery,
 
   return hash;
 }
+/*-----------------------------------------------------------------*/
+unsigned int 
+HashBuffer(const char *buf, int len, unsigned int hash)
+{
+  /* same mixing as HashString, but for binary data */
+  int i;
+
+  for (i = 0; i < len; i++)
+    hash += (_rotl(hash, 19) + buf[i]);
+
+  return hash;
+}
+/*-----------------------------------------------------------------*/
+unsigned int
+HashBufferNoCase(const char *buf, int len, unsigned int hash)
+{
+  /* like HashBuffer, ignoring case */
+  int i;
+
+  for (i = 0; i < len; i++)
+    hash += (_rotl(hash, 19) + tolower(buf[i]));
+
+  return hash;
+}
+/*-----------------------------------------------------------------*/
+void
+StrBufPrintf(StrBuf *sb, const char *fmt, ...)
+{
+  /* appends to the buffer, growing it as needed */
+  va_list ap;
+  int len;
+
+  while (1) {
+    int avail = sb->sb_alloc - sb->sb_used;
+    va_start(ap, fmt);
+    len = vsnprintf(sb->sb_buf + sb->sb_used, avail, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+      return;
+    if (len < avail)
+      break;
+    sb->sb_alloc = MAX(sb->sb_alloc * 2, sb->sb_used + len + 1024);
+    if ((sb->sb_buf = xrealloc(sb->sb_buf, sb->sb_alloc)) == NULL)
+      NiceExit(-1, "out of memory");
+  }
+  sb->sb_used += len;
+}
+/*-----------------------------------------------------------------*/
+void
+StrBufFree(StrBuf *sb)
+{
+  if (sb->sb_buf != NULL)
+    xfree(sb->sb_buf);
+  memset(sb, 0, sizeof(StrBuf));
+}
@@ -18,6 +18,13 @@
 
 typedef void* HANDLE;
 
+/* growable string buffer, start it zeroed */
+typedef struct StrBuf {
+  char *sb_buf;
+  int sb_used;
+  int sb_alloc;
+} StrBuf;
+
 /* stripped version of applib.c for codemux */
 
 extern char *GetNextLine(FILE *file);
@@ -34,6 +41,12 @@ extern int WriteLog(HANDLE file, const char* data, int size, int forceFlush);
 extern void DailyReopenLogF(HANDLE file);
 extern unsigned int HashString(const char *name, unsigned int hash, 
 			       int endOnQuery, int skipLastIfDot);
+extern unsigned int HashBuffer(const char *buf, int len, unsigned int hash);
+extern unsigned int HashBufferNoCase(const char *buf, int len,
+				     unsigned int hash);
+extern void StrBufPrintf(StrBuf *sb, const char *fmt, ...)
+     __attribute__ ((format (printf, 2, 3)));
+extern void StrBufFree(StrBuf *sb);
 
 #define FlushLogF(h)  WriteLog(h, NULL, 0, TRUE)
 
@@ -0,0 +1,146 @@
+#define _GNU_SOURCE		/* for getaddrinfo_a */
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "codemuxlib.h"
+#include "debug.h"
+#include "dnscache.h"
+
+typedef struct DnsEntry {
+  char *de_name;		/* NULL if the slot is free */
+  int de_refs;			/* backends with this name */
+  struct in_addr de_addr;
+  int de_valid;			/* resolved at least once */
+  int de_failing;		/* last lookup failed */
+  int de_expires;
+  struct gaicb *de_req;		/* lookup in flight, or NULL */
+} DnsEntry;
+
+static DnsEntry *dnsCache;
+static int dnsCacheSize;
+static const struct addrinfo dnsHints = {
+  .ai_family = AF_INET, .ai_socktype = SOCK_STREAM
+};
+
+/*-----------------------------------------------------------------*/
+int
+DnsRef(const char *name)
+{
+  /* returns the entry for the name, making one if needed. the
+     lookup itself waits for DnsRun */
+  int i, slot = -1;
+
+  for (i = 0; i < dnsCacheSize; i++) {
+    if (dnsCache[i].de_name == NULL) {
+      if (slot < 0)
+	slot = i;
+    }
+    else if (strcasecmp(dnsCache[i].de_name, name) == 0) {
+      dnsCache[i].de_refs++;
+      return(i);
+    }
+  }
+  if (slot < 0) {
+    slot = dnsCacheSize;
+    dnsCacheSize = MAX(8, dnsCacheSize * 2);
+    dnsCache = xrealloc(dnsCache, dnsCacheSize * sizeof(DnsEntry));
+    if (dnsCache == NULL)
+      NiceExit(-1, "out of memory");
+    memset(&dnsCache[slot], 0, (dnsCacheSize - slot) * sizeof(DnsEntry));
+  }
+  dnsCache[slot].de_name = xstrdup(name);
+  dnsCache[slot].de_refs = 1;
+  return(slot);
+}
+/*-----------------------------------------------------------------*/
+void
+DnsRelease(int which)
+{
+  /* the entry goes away in DnsRun, once no lookup is in flight */
+  dnsCache[which].de_refs--;
+}
+/*-----------------------------------------------------------------*/
+const char *
+DnsName(int which)
+{
+  return(dnsCache[which].de_name);
+}
+/*-----------------------------------------------------------------*/
+int
+DnsLookup(int which, struct in_addr *addr)
+{
+  DnsEntry *de = &dnsCache[which];
+
+  if (!de->de_valid)
+    return(FAILURE);
+  if (addr != NULL)
+    *addr = de->de_addr;
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static void
+DnsDone(DnsEntry *de, int err, int now)
+{
+  struct addrinfo *ai = de->de_req->ar_result;
+
+  if (err == 0 && ai != NULL) {
+    struct in_addr addr = ((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+    if (!de->de_valid || addr.s_addr != de->de_addr.s_addr)
+      fprintf(stderr, "backend %s is at %s\n", de->de_name, inet_ntoa(addr));
+    de->de_addr = addr;
+    de->de_valid = TRUE;
+    de->de_failing = FALSE;
+    de->de_expires = now + DNS_TTL;
+  }
+  else {
+    /* just once until it works again */
+    if (!de->de_failing)
+      fprintf(stderr, "cannot resolve backend %s: %s\n", de->de_name,
+	      gai_strerror(err));
+    de->de_failing = TRUE;
+    de->de_expires = now + DNS_RETRY;
+  }
+  if (ai != NULL)
+    freeaddrinfo(ai);
+  xfree(de->de_req);
+  de->de_req = NULL;
+}
+/*-----------------------------------------------------------------*/
+void
+DnsRun(int now)
+{
+  /* picks up finished lookups, and starts any that are due. there
+     are only as many entries as distinct backend names, so a pass
+     over them all is cheap */
+  int i, err;
+
+  for (i = 0; i < dnsCacheSize; i++) {
+    DnsEntry *de = &dnsCache[i];
+
+    if (de->de_name == NULL)
+      continue;
+    if (de->de_req != NULL) {
+      if ((err = gai_error(de->de_req)) == EAI_INPROGRESS)
+	continue;
+      DnsDone(de, err, now);
+    }
+    if (de->de_refs <= 0) {
+      xfree(de->de_name);
+      memset(de, 0, sizeof(DnsEntry));
+      continue;
+    }
+    if (de->de_expires > now)
+      continue;
+
+    de->de_req = xcalloc(1, sizeof(struct gaicb));
+    de->de_req->ar_name = de->de_name;
+    de->de_req->ar_request = &dnsHints;
+    if (getaddrinfo_a(GAI_NOWAIT, &de->de_req, 1, NULL) != 0) {
+      xfree(de->de_req);
+      de->de_req = NULL;
+      de->de_expires = now + DNS_RETRY;
+    }
+  }
+}
+/*-----------------------------------------------------------------*/
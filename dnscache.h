@@ -0,0 +1,24 @@
+#ifndef _DNSCACHE_H_
+#define _DNSCACHE_H_
+
+#include <netinet/in.h>
+
+/*
+  names of backends, looked up off the main loop by getaddrinfo_a.
+  an answer is used for DNS_TTL seconds, then the name is looked up
+  again while the old answer is still used - for good, if the new
+  lookup fails. entries are shared by every backend with the name.
+*/
+
+#define DNS_TTL   60
+#define DNS_RETRY 5		/* after a failed lookup */
+
+extern int  DnsRef(const char *name);
+extern void DnsRelease(int which);
+extern const char *DnsName(int which);
+/* SUCCESS if the name has resolved, addr may be NULL */
+extern int  DnsLookup(int which, struct in_addr *addr);
+/* call every pass of the main loop */
+extern void DnsRun(int now);
+
+#endif //_DNSCACHE_H_
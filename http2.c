@@ -0,0 +1,234 @@
+#include <string.h>
+#include "codemuxlib.h"
+#include "debug.h"
+#include "http2.h"
+
+#define H2_FRAME_HEADERS 0x1
+#define H2_FLAG_PADDED   0x8
+#define H2_FLAG_PRIORITY 0x20
+
+#define HPACK_AUTHORITY 1	/* static table entries we look for */
+#define HPACK_HOST      38
+#define HPACK_NAME_MAX  64
+
+/* code lengths of the HPACK Huffman code, RFC 7541 appendix B. the
+   code is canonical, so the lengths are all it takes to decode it.
+   the last entry is EOS */
+#define HUFF_SYMS    257
+#define HUFF_MAX_LEN 30
+static const unsigned char huffLen[HUFF_SYMS] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30,
+};
+static int huffCount[HUFF_MAX_LEN + 1];	/* codes of each length */
+static short huffSorted[HUFF_SYMS];	/* by length, then symbol */
+
+/*-----------------------------------------------------------------*/
+static void
+HuffInit(void)
+{
+  int offset[HUFF_MAX_LEN + 1];
+  int i;
+
+  if (huffCount[5] != 0)
+    return;
+  for (i = 0; i < HUFF_SYMS; i++)
+    huffCount[huffLen[i]]++;
+  offset[1] = 0;
+  for (i = 1; i < HUFF_MAX_LEN; i++)
+    offset[i + 1] = offset[i] + huffCount[i];
+  for (i = 0; i < HUFF_SYMS; i++)
+    huffSorted[offset[huffLen[i]]++] = i;
+}
+/*-----------------------------------------------------------------*/
+static int
+HuffDecode(const unsigned char *in, int inLen, char *out, int outSize)
+{
+  /* a bit at a time, checking each length's range of codes in
+     turn. returns the length written, or -1 */
+  int code = 0, first = 0, index = 0, len = 0;
+  int outLen = 0;
+  int i;
+
+  HuffInit();
+  for (i = 0; i < inLen * 8; i++) {
+    code |= (in[i >> 3] >> (7 - (i & 7))) & 1;
+    if (++len > HUFF_MAX_LEN)
+      return(-1);
+    if (code < first + huffCount[len]) {
+      int sym = huffSorted[index + code - first];
+      if (sym == HUFF_SYMS - 1 || outLen >= outSize - 1)
+	return(-1);
+      out[outLen++] = sym;
+      code = first = index = len = 0;
+      continue;
+    }
+    index += huffCount[len];
+    first = (first + huffCount[len]) << 1;
+    code <<= 1;
+  }
+  /* what's left is padding, the start of EOS */
+  out[outLen] = '\0';
+  return(outLen);
+}
+/*-----------------------------------------------------------------*/
+static int
+HpackInt(const unsigned char *buf, int len, int *pos, int prefix, int *val)
+{
+  int max = (1 << prefix) - 1;
+  int shift = 0;
+
+  if (*pos >= len)
+    return(FAILURE);
+  if ((*val = buf[(*pos)++] & max) < max)
+    return(SUCCESS);
+  do {
+    if (*pos >= len || shift > 21)
+      return(FAILURE);
+    *val += (buf[*pos] & 0x7f) << shift;
+    shift += 7;
+  } while (buf[(*pos)++] & 0x80);
+  return(SUCCESS);
+}
+/*-----------------------------------------------------------------*/
+static int
+HpackString(const unsigned char *buf, int len, int *pos,
+	    char *out, int outSize)
+{
+  /* decodes a string into out, or just skips it if out is NULL. one
+     that doesn't fit comes back empty. returns -1 if the block is
+     broken */
+  int huff, strLen, start, outLen = -1;
+
+  if (*pos >= len)
+    return(-1);
+  huff = buf[*pos] & 0x80;
+  if (HpackInt(buf, len, pos, 7, &strLen) != SUCCESS ||
+      strLen > len - *pos)
+    return(-1);
+  start = *pos;
+  *pos += strLen;
+  if (out == NULL)
+    return(0);
+  if (huff)
+    outLen = HuffDecode(&buf[start], strLen, out, outSize);
+  else if (strLen < outSize) {
+    memcpy(out, &buf[start], strLen);
+    out[strLen] = '\0';
+    outLen = strLen;
+  }
+  if (outLen < 0 || strlen(out) != outLen)
+    out[0] = '\0';		/* too long, or has a NUL */
+  return(0);
+}
+/*-----------------------------------------------------------------*/
+static int
+HpackFindAuthority(const unsigned char *buf, int len, char *name,
+		   int nameSize)
+{
+  /* walks the header block for :authority, or failing that Host */
+  char field[HPACK_NAME_MAX];
+  int pos = 0;
+  int found = FALSE;
+
+  while (pos < len) {
+    int rep = buf[pos];
+    int index, isAuth, isHost;
+
+    if (rep & 0x80) {
+      /* indexed field - the static :authority has no value */
+      if (HpackInt(buf, len, &pos, 7, &index) != SUCCESS)
+	return(H2_NONE);
+      continue;
+    }
+    if ((rep & 0xe0) == 0x20) {
+      /* dynamic table size update */
+      if (HpackInt(buf, len, &pos, 5, &index) != SUCCESS)
+	return(H2_NONE);
+      continue;
+    }
+
+    /* a literal, with incremental indexing or without */
+    if (HpackInt(buf, len, &pos, (rep & 0x40) ? 6 : 4, &index) != SUCCESS)
+      return(H2_NONE);
+    if (index == 0) {
+      if (HpackString(buf, len, &pos, field, sizeof(field)) < 0)
+	return(H2_NONE);
+      isAuth = (strcmp(field, ":authority") == 0);
+      isHost = (strcmp(field, "host") == 0);
+    }
+    else {
+      isAuth = (index == HPACK_AUTHORITY);
+      isHost = (index == HPACK_HOST);
+    }
+    if (!isAuth && !(isHost && !found)) {
+      if (HpackString(buf, len, &pos, NULL, 0) < 0)
+	return(H2_NONE);
+      continue;
+    }
+    if (HpackString(buf, len, &pos, name, nameSize) < 0)
+      return(H2_NONE);
+    if (name[0] != '\0') {
+      if (isAuth)
+	return(H2_FOUND);
+      found = TRUE;
+    }
+  }
+  return(found ? H2_FOUND : H2_NONE);
+}
+/*-----------------------------------------------------------------*/
+int
+Http2FindAuthority(const unsigned char *buf, int len, char *name,
+		   int nameSize)
+{
+  /* skips the client's SETTINGS and anything else up to its first
+     HEADERS frame. only that frame's own fragment is looked at -
+     the pseudo-headers come first, so the host is always in it */
+  int pos = H2_PREFACE_LEN;
+
+  while (1) {
+    int frameLen, type, flags, start, end;
+
+    if (pos + 9 > len)
+      return(H2_NEED_MORE);
+    frameLen = (buf[pos] << 16) | (buf[pos+1] << 8) | buf[pos+2];
+    type = buf[pos+3];
+    flags = buf[pos+4];
+    pos += 9;
+    if (type != H2_FRAME_HEADERS) {
+      pos += frameLen;
+      continue;
+    }
+
+    if (pos + frameLen > len)
+      return(H2_NEED_MORE);
+    start = pos;
+    end = pos + frameLen;
+    if (flags & H2_FLAG_PADDED) {
+      if (start >= end)
+	return(H2_NONE);
+      end -= buf[start++];
+    }
+    if (flags & H2_FLAG_PRIORITY)
+      start += 5;
+    if (start > end)
+      return(H2_NONE);
+    return(HpackFindAuthority(&buf[start], end - start, name, nameSize));
+  }
+}
+/*-----------------------------------------------------------------*/
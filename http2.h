@@ -0,0 +1,22 @@
+#ifndef _HTTP2_H_
+#define _HTTP2_H_
+
+/*
+  just enough HTTP/2 to route a cleartext connection by its first
+  request. the frames are only read, never changed, and HPACK is
+  decoded with the static table alone, since nothing can be in the
+  dynamic one before the first request.
+*/
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+#define H2_FOUND     0
+#define H2_NEED_MORE 1
+#define H2_NONE      2		/* first request names no host */
+
+/* buf starts with the preface */
+extern int Http2FindAuthority(const unsigned char *buf, int len,
+			      char *name, int nameSize);
+
+#endif //_HTTP2_H_
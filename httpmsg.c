@@ -0,0 +1,277 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "codemuxlib.h"
+#include "debug.h"
+#include "httpmsg.h"
+
+/*-----------------------------------------------------------------*/
+void
+HttpMsgInit(HttpMsg *hm, int isResponse)
+{
+  memset(hm, 0, sizeof(HttpMsg));
+  hm->hm_isResponse = isResponse;
+  hm->hm_minor = -1;
+  hm->hm_length = -1;
+}
+/*-----------------------------------------------------------------*/
+static void
+HttpMsgBroken(HttpMsg *hm)
+{
+  /* can't tell where it ends, so it ends with the connection */
+  hm->hm_state = HM_UNTIL_CLOSE;
+  hm->hm_keepAlive = FALSE;
+}
+/*-----------------------------------------------------------------*/
+static void
+HttpMsgAppend(HttpMsg *hm, const char *buf, int len)
+{
+  /* keeps the start of the line and, separately, its last few
+     bytes */
+  int keep = MIN(len, HM_LINE_MAX - 1 - hm->hm_lineLen);
+
+  memcpy(&hm->hm_line[hm->hm_lineLen], buf, keep);
+  hm->hm_lineLen += keep;
+
+  if (len >= HM_TAIL_MAX) {
+    memcpy(hm->hm_tail, &buf[len - HM_TAIL_MAX], HM_TAIL_MAX);
+    hm->hm_tailLen = HM_TAIL_MAX;
+    return;
+  }
+  keep = MIN(hm->hm_tailLen, HM_TAIL_MAX - len);
+  memmove(hm->hm_tail, &hm->hm_tail[hm->hm_tailLen - keep], keep);
+  memcpy(&hm->hm_tail[keep], buf, len);
+  hm->hm_tailLen = keep + len;
+}
+/*-----------------------------------------------------------------*/
+static void
+HttpMsgStartLine(HttpMsg *hm)
+{
+  char *line = hm->hm_line;
+  char *tail = hm->hm_tail;
+  int tailLen = hm->hm_tailLen;
+
+  if (hm->hm_isResponse) {
+    if (strncmp(line, "HTTP/1.", 7) != 0 || !isdigit((int) line[7]) ||
+	line[8] != ' ' || !isdigit((int) line[9])) {
+      HttpMsgBroken(hm);
+      return;
+    }
+    hm->hm_minor = line[7] - '0';
+    hm->hm_status = atoi(&line[9]);
+    hm->hm_state = HM_HEADERS;
+    return;
+  }
+
+  /* a request line's version is at its end, which may be past what
+     we kept of the line itself */
+  if (line[0] == '\0')
+    return;			/* stray CRLF between requests */
+  hm->hm_isHead = (strncmp(line, "HEAD ", 5) == 0);
+  if (tailLen < 8 || memcmp(&tail[tailLen - 8], "HTTP/1.", 7) != 0 ||
+      !isdigit((int) tail[tailLen - 1]) ||
+      strncmp(line, "CONNECT ", 8) == 0) {
+    /* HTTP/0.9 has no headers, and CONNECT becomes a tunnel */
+    HttpMsgBroken(hm);
+    return;
+  }
+  hm->hm_minor = tail[tailLen - 1] - '0';
+  hm->hm_state = HM_HEADERS;
+}
+/*-----------------------------------------------------------------*/
+static void
+HttpMsgHeader(HttpMsg *hm)
+{
+  char *line = hm->hm_line;
+  char *val, *tok, *save;
+
+  if (isspace((int) line[0]))
+    return;			/* folded continuation */
+  StrcpyLower(line, line);
+  if ((val = strchr(line, ':')) == NULL)
+    return;
+  *val++ = '\0';
+  while (*val == ' ' || *val == '\t')
+    val++;
+
+  if (strcmp(line, "content-length") == 0) {
+    char *end;
+    long long len = strtoll(val, &end, 10);
+    while (*end == ' ' || *end == '\t')
+      end++;
+    if (!isdigit((int) *val) || *end != '\0' || len < 0 ||
+	(hm->hm_length >= 0 && hm->hm_length != len)) {
+      HttpMsgBroken(hm);
+      return;
+    }
+    hm->hm_length = len;
+  }
+  else if (strcmp(line, "transfer-encoding") == 0) {
+    if (strstr(val, "chunked") == NULL) {
+      HttpMsgBroken(hm);
+      return;
+    }
+    hm->hm_chunked = TRUE;
+  }
+  else if (strcmp(line, "connection") == 0) {
+    for (tok = strtok_r(val, ", \t", &save); tok != NULL;
+	 tok = strtok_r(NULL, ", \t", &save)) {
+      if (strcmp(tok, "close") == 0)
+	hm->hm_sawClose = TRUE;
+      else if (strcmp(tok, "keep-alive") == 0)
+	hm->hm_sawKeepAlive = TRUE;
+      else if (strcmp(tok, "upgrade") == 0)
+	hm->hm_sawUpgrade = TRUE;
+    }
+  }
+  else if (strcmp(line, "upgrade") == 0)
+    hm->hm_hasUpgrade = TRUE;
+}
+/*-----------------------------------------------------------------*/
+static void
+HttpMsgHeadersDone(HttpMsg *hm)
+{
+  int status = hm->hm_status;
+
+  if (hm->hm_isResponse && status >= 100 && status < 200 && status != 101) {
+    /* an interim response, the real one follows */
+    int noBody = hm->hm_noBody;
+    HttpMsgInit(hm, TRUE);
+    hm->hm_noBody = noBody;
+    return;
+  }
+
+  if (hm->hm_minor >= 1)
+    hm->hm_keepAlive = !hm->hm_sawClose;
+  else
+    hm->hm_keepAlive = hm->hm_sawKeepAlive && !hm->hm_sawClose;
+
+  if ((hm->hm_isResponse && status == 101) ||
+      (!hm->hm_isResponse && hm->hm_sawUpgrade && hm->hm_hasUpgrade)) {
+    /* whatever follows isn't HTTP, or may not be, if the server
+       agrees to switch */
+    hm->hm_upgrade = TRUE;
+    HttpMsgBroken(hm);
+    return;
+  }
+  if (hm->hm_isResponse && (hm->hm_noBody || status == 204 ||
+			    status == 304 || status < 200)) {
+    hm->hm_state = HM_DONE;
+    return;
+  }
+  if (hm->hm_chunked) {
+    /* a length alongside chunked is a smuggling attempt, at best */
+    if (hm->hm_length >= 0)
+      hm->hm_keepAlive = FALSE;
+    hm->hm_state = HM_CHUNK_SIZE;
+    return;
+  }
+  if (hm->hm_length > 0) {
+    hm->hm_left = hm->hm_length;
+    hm->hm_state = HM_BODY;
+    return;
+  }
+  if (hm->hm_length == 0 || !hm->hm_isResponse) {
+    hm->hm_state = HM_DONE;
+    return;
+  }
+  HttpMsgBroken(hm);		/* runs until the server closes */
+}
+/*-----------------------------------------------------------------*/
+static void
+HttpMsgChunkSize(HttpMsg *hm)
+{
+  char *end;
+  long long size = strtoll(hm->hm_line, &end, 16);
+
+  if (!isxdigit((int) hm->hm_line[0]) || size < 0 ||
+      (*end != '\0' && *end != ';' && *end != ' ' && *end != '\t')) {
+    HttpMsgBroken(hm);
+    return;
+  }
+  if (size == 0) {
+    hm->hm_state = HM_TRAILERS;
+    return;
+  }
+  hm->hm_left = size;
+  hm->hm_state = HM_CHUNK_DATA;
+}
+/*-----------------------------------------------------------------*/
+static void
+HttpMsgLine(HttpMsg *hm)
+{
+  /* called with a whole line, minus its newline */
+  if (hm->hm_lineLen > 0 && hm->hm_line[hm->hm_lineLen - 1] == '\r')
+    hm->hm_lineLen--;
+  if (hm->hm_tailLen > 0 && hm->hm_tail[hm->hm_tailLen - 1] == '\r')
+    hm->hm_tailLen--;
+  hm->hm_line[hm->hm_lineLen] = '\0';
+
+  switch (hm->hm_state) {
+  case HM_START:
+    HttpMsgStartLine(hm);
+    break;
+  case HM_HEADERS:
+    if (hm->hm_lineLen == 0)
+      HttpMsgHeadersDone(hm);
+    else
+      HttpMsgHeader(hm);
+    break;
+  case HM_CHUNK_SIZE:
+    HttpMsgChunkSize(hm);
+    break;
+  case HM_CHUNK_END:
+    if (hm->hm_lineLen == 0)
+      hm->hm_state = HM_CHUNK_SIZE;
+    else
+      HttpMsgBroken(hm);
+    break;
+  case HM_TRAILERS:
+    if (hm->hm_lineLen == 0)
+      hm->hm_state = HM_DONE;
+    break;
+  }
+  hm->hm_lineLen = 0;
+  hm->hm_tailLen = 0;
+}
+/*-----------------------------------------------------------------*/
+int
+HttpMsgFeed(HttpMsg *hm, const char *buf, int len)
+{
+  /* returns how many bytes belong to this message. any after its
+     end are left alone, and hm_extra is set */
+  int pos = 0;
+
+  while (pos < len) {
+    const char *nl;
+    int take;
+
+    switch (hm->hm_state) {
+    case HM_DONE:
+      hm->hm_extra = TRUE;
+      return(pos);
+    case HM_UNTIL_CLOSE:
+      return(len);
+    case HM_BODY:
+    case HM_CHUNK_DATA:
+      take = MIN(len - pos, hm->hm_left);
+      pos += take;
+      if ((hm->hm_left -= take) == 0)
+	hm->hm_state = (hm->hm_state == HM_BODY) ? HM_DONE : HM_CHUNK_END;
+      break;
+    default:
+      /* everything else comes a line at a time */
+      if ((nl = memchr(&buf[pos], '\n', len - pos)) == NULL) {
+	HttpMsgAppend(hm, &buf[pos], len - pos);
+	return(len);
+      }
+      take = nl - &buf[pos];
+      HttpMsgAppend(hm, &buf[pos], take);
+      pos += take + 1;
+      HttpMsgLine(hm);
+      break;
+    }
+  }
+  return(pos);
+}
+/*-----------------------------------------------------------------*/
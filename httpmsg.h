@@ -0,0 +1,49 @@
+#ifndef _HTTPMSG_H_
+#define _HTTPMSG_H_
+
+/*
+  finds where an HTTP/1.x request or response ends as its bytes go
+  by, without keeping them. only the first HM_LINE_MAX bytes of each
+  header line are looked at, which covers every header we care about.
+*/
+
+#define HM_LINE_MAX 128
+#define HM_TAIL_MAX 16		/* end of a long line, for its version */
+
+#define HM_START       0	/* request or status line */
+#define HM_HEADERS     1
+#define HM_BODY        2	/* hm_left bytes of body */
+#define HM_CHUNK_SIZE  3
+#define HM_CHUNK_DATA  4	/* hm_left bytes of this chunk */
+#define HM_CHUNK_END   5	/* CRLF after the chunk data */
+#define HM_TRAILERS    6
+#define HM_UNTIL_CLOSE 7	/* body runs until the connection closes */
+#define HM_DONE        8
+
+typedef struct HttpMsg {
+  int hm_state;			/* HM_* */
+  int hm_isResponse;
+  int hm_noBody;		/* response to a HEAD, set by the caller */
+  int hm_isHead;		/* request method was HEAD */
+  int hm_status;		/* response status */
+  int hm_minor;			/* HTTP/1.x, -1 if no version */
+  int hm_keepAlive;		/* connection may carry another message */
+  int hm_chunked;
+  int hm_sawClose;		/* Connection: close */
+  int hm_sawKeepAlive;		/* Connection: keep-alive */
+  int hm_sawUpgrade;		/* Connection: upgrade */
+  int hm_hasUpgrade;		/* an Upgrade header */
+  int hm_upgrade;		/* asks for, or switched to, another protocol */
+  int hm_extra;			/* more bytes followed the end */
+  long long hm_length;		/* Content-Length, or -1 */
+  long long hm_left;
+  char hm_line[HM_LINE_MAX];
+  int hm_lineLen;
+  char hm_tail[HM_TAIL_MAX];
+  int hm_tailLen;
+} HttpMsg;
+
+extern void HttpMsgInit(HttpMsg *hm, int isResponse);
+extern int  HttpMsgFeed(HttpMsg *hm, const char *buf, int len);
+
+#endif //_HTTPMSG_H_
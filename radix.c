@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#include "codemuxlib.h"
+#include "debug.h"
+#include "radix.h"
+
+/*-----------------------------------------------------------------*/
+void
+RadixInit(RadixTree *rt)
+{
+  memset(rt, 0, sizeof(RadixTree));
+}
+/*-----------------------------------------------------------------*/
+void
+RadixFree(RadixTree *rt)
+{
+  if (rt->rt_nodes != NULL)
+    xfree(rt->rt_nodes);
+  if (rt->rt_labels != NULL)
+    xfree(rt->rt_labels);
+  RadixInit(rt);
+}
+/*-----------------------------------------------------------------*/
+static int
+RadixNewNode(RadixTree *rt, int label, int labelLen)
+{
+  RadixNode *rn;
+
+  if (rt->rt_numNodes >= rt->rt_numNodesAlloc) {
+    rt->rt_numNodesAlloc = MAX(16, rt->rt_numNodesAlloc * 2);
+    rt->rt_nodes = xrealloc(rt->rt_nodes,
+			    rt->rt_numNodesAlloc * sizeof(RadixNode));
+    if (rt->rt_nodes == NULL)
+      NiceExit(-1, "out of memory");
+  }
+  rn = &rt->rt_nodes[rt->rt_numNodes];
+  rn->rn_label = label;
+  rn->rn_labelLen = labelLen;
+  rn->rn_val = RADIX_NONE;
+  rn->rn_child = RADIX_NONE;
+  rn->rn_sibling = RADIX_NONE;
+  return(rt->rt_numNodes++);
+}
+/*-----------------------------------------------------------------*/
+static int
+RadixAddLabel(RadixTree *rt, const char *key, int len)
+{
+  /* appends the label to the pool, returns its offset */
+  int off;
+
+  if (rt->rt_labelsUsed + len > rt->rt_labelsAlloc) {
+    rt->rt_labelsAlloc = MAX(rt->rt_labelsUsed + len,
+			     MAX(256, rt->rt_labelsAlloc * 2));
+    rt->rt_labels = xrealloc(rt->rt_labels, rt->rt_labelsAlloc);
+    if (rt->rt_labels == NULL)
+      NiceExit(-1, "out of memory");
+  }
+  off = rt->rt_labelsUsed;
+  memcpy(&rt->rt_labels[off], key, len);
+  rt->rt_labelsUsed += len;
+  return(off);
+}
+/*-----------------------------------------------------------------*/
+int
+RadixNewRoot(RadixTree *rt)
+{
+  return(RadixNewNode(rt, 0, 0));
+}
+/*-----------------------------------------------------------------*/
+static int
+RadixFindChild(const RadixTree *rt, int node, char c)
+{
+  int child;
+
+  for (child = rt->rt_nodes[node].rn_child; child != RADIX_NONE;
+       child = rt->rt_nodes[child].rn_sibling) {
+    if (rt->rt_labels[rt->rt_nodes[child].rn_label] == c)
+      return(child);
+  }
+  return(RADIX_NONE);
+}
+/*-----------------------------------------------------------------*/
+int
+RadixInsert(RadixTree *rt, int root, const char *key, int len, int val)
+{
+  /* stores val under key, returns the value it replaced */
+  int node = root;
+  int pos = 0;
+  int old;
+
+  while (pos < len) {
+    int child, common, mid;
+    RadixNode *cn;
+
+    if ((child = RadixFindChild(rt, node, key[pos])) == RADIX_NONE) {
+      /* no edge starts with this char - hang a new leaf here */
+      int label = RadixAddLabel(rt, &key[pos], len - pos);
+      child = RadixNewNode(rt, label, len - pos);
+      rt->rt_nodes[child].rn_sibling = rt->rt_nodes[node].rn_child;
+      rt->rt_nodes[node].rn_child = child;
+      node = child;
+      break;
+    }
+
+    cn = &rt->rt_nodes[child];
+    for (common = 1; common < cn->rn_labelLen && pos + common < len;
+	 common++) {
+      if (rt->rt_labels[cn->rn_label + common] != key[pos + common])
+	break;
+    }
+    if (common < cn->rn_labelLen) {
+      /* split the edge - the pool is append-only, so both halves
+	 just point into the existing label */
+      mid = RadixNewNode(rt, rt->rt_nodes[child].rn_label, common);
+      cn = &rt->rt_nodes[child];
+      rt->rt_nodes[mid].rn_child = child;
+      rt->rt_nodes[mid].rn_sibling = cn->rn_sibling;
+      cn->rn_sibling = RADIX_NONE;
+      cn->rn_label += common;
+      cn->rn_labelLen -= common;
+      if (rt->rt_nodes[node].rn_child == child)
+	rt->rt_nodes[node].rn_child = mid;
+      else {
+	int walk = rt->rt_nodes[node].rn_child;
+	while (rt->rt_nodes[walk].rn_sibling != child)
+	  walk = rt->rt_nodes[walk].rn_sibling;
+	rt->rt_nodes[walk].rn_sibling = mid;
+      }
+      child = mid;
+    }
+    node = child;
+    pos += common;
+  }
+
+  old = rt->rt_nodes[node].rn_val;
+  rt->rt_nodes[node].rn_val = val;
+  return(old);
+}
+/*-----------------------------------------------------------------*/
+int
+RadixFind(const RadixTree *rt, int root, const char *key, int len)
+{
+  /* exact match, returns RADIX_NONE if not found */
+  int node = root;
+  int pos = 0;
+
+  while (pos < len) {
+    RadixNode *cn;
+
+    if ((node = RadixFindChild(rt, node, key[pos])) == RADIX_NONE)
+      return(RADIX_NONE);
+    cn = &rt->rt_nodes[node];
+    if (cn->rn_labelLen > len - pos ||
+	memcmp(&rt->rt_labels[cn->rn_label], &key[pos], cn->rn_labelLen))
+      return(RADIX_NONE);
+    pos += cn->rn_labelLen;
+  }
+  return(rt->rt_nodes[node].rn_val);
+}
+/*-----------------------------------------------------------------*/
+void
+RadixWalkPrefixes(const RadixTree *rt, int root, const char *key, int len,
+		  RadixPrefixFunc func, void *arg)
+{
+  int node = root;
+  int pos = 0;
+
+  while (1) {
+    RadixNode *cn = &rt->rt_nodes[node];
+
+    if (cn->rn_val != RADIX_NONE && func(cn->rn_val, pos, arg))
+      return;
+    if (pos >= len ||
+	(node = RadixFindChild(rt, node, key[pos])) == RADIX_NONE)
+      return;
+    cn = &rt->rt_nodes[node];
+    if (cn->rn_labelLen > len - pos ||
+	memcmp(&rt->rt_labels[cn->rn_label], &key[pos], cn->rn_labelLen))
+      return;
+    pos += cn->rn_labelLen;
+  }
+}
+/*-----------------------------------------------------------------*/
@@ -0,0 +1,47 @@
+#ifndef _RADIX_H_
+#define _RADIX_H_
+
+/*
+  compressed prefix trie (radix tree) with integer values.
+
+  all nodes live in one array and all edge labels in one string pool,
+  so a tree is position independent and several tries (a forest) can
+  share the same storage. node indices are stable across inserts;
+  pointers into the arrays are not.
+*/
+
+#define RADIX_NONE (-1)
+
+typedef struct RadixNode {
+  int rn_label;			/* offset of edge label in rt_labels */
+  int rn_labelLen;		/* length of edge label */
+  int rn_val;			/* value if a key ends here, else RADIX_NONE */
+  int rn_child;			/* index of first child, or RADIX_NONE */
+  int rn_sibling;		/* index of next sibling, or RADIX_NONE */
+} RadixNode;
+
+typedef struct RadixTree {
+  RadixNode *rt_nodes;
+  int rt_numNodes;
+  int rt_numNodesAlloc;
+  char *rt_labels;		/* label pool, never compacted */
+  int rt_labelsUsed;
+  int rt_labelsAlloc;
+} RadixTree;
+
+/* called for each stored key that is a prefix of the lookup key,
+   shortest first. return non-zero to stop the walk */
+typedef int (*RadixPrefixFunc)(int val, int matchLen, void *arg);
+
+extern void RadixInit(RadixTree *rt);
+extern void RadixFree(RadixTree *rt);
+extern int  RadixNewRoot(RadixTree *rt);
+extern int  RadixInsert(RadixTree *rt, int root,
+			const char *key, int len, int val);
+extern int  RadixFind(const RadixTree *rt, int root,
+		      const char *key, int len);
+extern void RadixWalkPrefixes(const RadixTree *rt, int root,
+			      const char *key, int len,
+			      RadixPrefixFunc func, void *arg);
+
+#endif //_RADIX_H_